@@ -0,0 +1,978 @@
+/*
+================================================================================
+
+    Xarax - world baker
+    written by Sebastian Steinhauer <s.steinhauer@yahoo.de>
+
+
+    This is free and unencumbered software released into the public domain.
+
+    For more information, please refer to <https://unlicense.org>
+
+
+================================================================================
+*/
+/*
+================================================================================
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include "SDL.h"
+
+
+/*
+================================================================================
+
+        DEFINES
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+#define WORLD_MAGIC         "XWLD"
+#define WORLD_VERSION       3
+#define WORLD_HEADER_SIZE   8       /* magic, LE16 version, LE16 sections */
+#define WORLD_ENTRY_SIZE    20      /* tag, LE32 pack, offset, size, raw size */
+#define WORLD_PACK_RAW      0
+#define WORLD_PACK_RLE      1
+
+#define MAP_CHUNK_SIZE      32
+#define MAP_CHUNK_BYTES     (2 * MAP_CHUNK_SIZE * MAP_CHUNK_SIZE)
+#define MAX_MAP_SIZE        2048    /* tiles per side */
+#define LEGACY_MAP_SIZE     256
+#define MAX_LAYERS          256
+#define NUM_TILES           256
+
+#define TILE_SIGNAL_TILE    0xf5    /* the code after it is a tile id */
+
+#define NUM_STRINGS         4096
+#define TEXT_DATA_SIZE      (1 << 16)
+#define LEGACY_INFO_SIZE    5       /* x, y, z, LE16 offset */
+
+#define HASH_SEED           0xcbf29ce484222325ull
+#define BAKE_VERSION        2       /* bump when the same source bakes differently */
+
+
+/*----------------------------------------------------------------------------*/
+typedef struct buffer_t {
+    Uint8                   *data;
+    size_t                  size, capacity;
+} buffer_t;
+
+typedef struct layer_t {
+    char                    name[64];       /* of the group */
+    const char              *tiles_src, *codes_src;     /* JSON array or CSV text */
+    size_t                  tiles_len, codes_len;
+    Uint64                  hash;           /* of both sources */
+    int                     reused;         /* chunks copied from the old file */
+    Uint8                   *tiles, *codes;
+    Uint32                  *offsets;       /* into packed, one per chunk */
+    Uint32                  *sizes;         /* 0 = empty */
+    buffer_t                packed;
+    buffer_t                spawns;         /* picture, LE16 x, LE16 y, z */
+} layer_t;
+
+typedef struct old_world_t {
+    Uint8                   *data;          /* the previous output, or NULL */
+    size_t                  size;
+    const Uint8             *chunks;        /* its CHNK section */
+    const Uint8             *spawns;        /* its SPWN section */
+    Uint32                  spawns_size;
+    const Uint8             *hashes;        /* its HASH section */
+    Uint32                  num_hashes;
+    const Uint8             *text, *info;
+    Uint32                  text_size, info_size;
+} old_world_t;
+
+
+/*
+================================================================================
+
+        GLOBAL VARIABLES
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static const char           *map_file = "./dev/world.tmx";
+static const char           *strings_file = "./dev/strings.txt";
+static const char           *out_file = "world.dat";
+static int                  legacy = 0;
+static int                  full_build = 0;
+static int                  map_width, map_height;      /* in tiles */
+static int                  map_cols, map_rows;         /* in chunks */
+
+
+/*----------------------------------------------------------------------------*/
+#include "../src/tile_flags.h"
+
+
+/*----------------------------------------------------------------------------*/
+static char                 *map_source = NULL;
+static char                 *strings_source = NULL;
+static size_t               strings_size = 0;
+static old_world_t          old;
+static layer_t              *layers[MAX_LAYERS];
+static int                  num_layers = 0;
+static buffer_t             text, info;
+static Uint64               source_seed;        /* the baker version and the spawn class */
+static Uint64               text_hash;
+static int                  text_reused = 0;
+static SDL_atomic_t         next_job;
+
+
+/*
+================================================================================
+
+        GENERAL FUNCTIONS
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static void panic(const char *fmt, ...) {
+    va_list                 va;
+    char                    message[1024];
+
+    va_start(va, fmt);
+    SDL_vsnprintf(message, sizeof(message), fmt, va);
+    va_end(va);
+
+    /* any stage may fail, the output is only replaced at the very end */
+    fprintf(stderr, "Panic! %s\n", message);
+    exit(1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint64 hash_bytes(Uint64 hash, const void *data, size_t size) {
+    const Uint8             *p = data;
+
+    /* FNV-1a, like hash_state() in the game */
+    while (size-- > 0)
+        hash = (hash ^ *p++) * 0x100000001b3ull;
+    return hash;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint32 read_le16(const Uint8 *p) {
+    return p[0] | (p[1] << 8);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint32 read_le32(const Uint8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((Uint32)p[3] << 24);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint64 read_le64(const Uint8 *p) {
+    return read_le32(p) | ((Uint64)read_le32(p + 4) << 32);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void put_bytes(buffer_t *buf, const void *data, size_t size) {
+    if (buf->size + size > buf->capacity) {
+        buf->capacity = (buf->size + size) * 2;
+        if ((buf->data = SDL_realloc(buf->data, buf->capacity)) == NULL)
+            panic("SDL_realloc() failed!");
+    }
+    SDL_memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void put_u8(buffer_t *buf, Uint32 value) {
+    Uint8                   b = (Uint8)value;
+
+    put_bytes(buf, &b, 1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void put_le16(buffer_t *buf, Uint32 value) {
+    put_u8(buf, value);
+    put_u8(buf, value >> 8);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void put_le32(buffer_t *buf, Uint32 value) {
+    put_le16(buf, value);
+    put_le16(buf, value >> 16);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void put_le64(buffer_t *buf, Uint64 value) {
+    put_le32(buf, (Uint32)value);
+    put_le32(buf, (Uint32)(value >> 32));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void pack_rle(buffer_t *out, const Uint8 *data, size_t size) {
+    size_t                  i, run, start = 0, literal = 0;
+
+    /* 0x00-0x7f: n+1 literal bytes follow, 0x80-0xff: next byte repeated n-126 times */
+    for (i = 0; i < size;) {
+        for (run = 1; (i + run < size) && (run < 129) && (data[i + run] == data[i]); ++run);
+        if (run >= 3) {
+            if (literal > 0) {
+                put_u8(out, literal - 1);
+                put_bytes(out, data + start, literal);
+                literal = 0;
+            }
+            put_u8(out, 0x80 | (run - 2));
+            put_u8(out, data[i]);
+            i += run;
+        } else {
+            if (literal++ == 0)
+                start = i;
+            ++i;
+            if (literal == 128) {
+                put_u8(out, 127);
+                put_bytes(out, data + start, literal);
+                literal = 0;
+            }
+        }
+    }
+    if (literal > 0) {
+        put_u8(out, literal - 1);
+        put_bytes(out, data + start, literal);
+    }
+}
+
+
+/*
+================================================================================
+
+        MAP SOURCES
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static const char *skip_space(const char *p) {
+    while (SDL_isspace((unsigned char)*p))
+        ++p;
+    return p;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *skip_json(const char *p) {
+    int                     depth = 0;
+
+    /* just far enough to step over any value, nothing is decoded */
+    for (p = skip_space(p); *p != '\0'; ++p) {
+        if (*p == '"') {
+            for (++p; (*p != '"') && (*p != '\0'); ++p)
+                if ((*p == '\\') && (p[1] != '\0'))
+                    ++p;
+            if (*p == '\0')
+                break;
+            if (depth == 0)
+                return p + 1;
+        } else if ((*p == '[') || (*p == '{')) {
+            ++depth;
+        } else if ((*p == ']') || (*p == '}')) {
+            if (depth == 0)
+                return p;
+            if (--depth == 0)
+                return p + 1;
+        } else if ((depth == 0) && ((*p == ',') || SDL_isspace((unsigned char)*p))) {
+            return p;
+        }
+    }
+    panic("%s is not valid JSON!", map_file);
+    return NULL;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *find_member(const char *p, const char *key) {
+    const char              *name;
+    size_t                  len = SDL_strlen(key);
+    int                     match;
+
+    if (*(p = skip_space(p)) != '{')
+        return NULL;
+    for (p = skip_space(p + 1); *p == '"';) {
+        name = p + 1;
+        p = skip_json(p);
+        match = ((size_t)(p - name - 1) == len) && (SDL_memcmp(name, key, len) == 0);
+        if (*(p = skip_space(p)) != ':')
+            panic("%s is not valid JSON!", map_file);
+        p = skip_space(p + 1);
+        if (match)
+            return p;
+        if (*(p = skip_space(skip_json(p))) == ',')
+            p = skip_space(p + 1);
+    }
+    return NULL;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *first_element(const char *p) {
+    if ((p == NULL) || (*(p = skip_space(p)) != '['))
+        return NULL;
+    p = skip_space(p + 1);
+    return *p == ']' ? NULL : p;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *next_element(const char *p) {
+    p = skip_space(skip_json(p));
+    return *p == ',' ? skip_space(p + 1) : NULL;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void copy_string(const char *p, char *dst, size_t size) {
+    const char              *end;
+
+    /* layer names need no unescaping */
+    if ((p == NULL) || (*p != '"')) {
+        SDL_strlcpy(dst, "?", size);
+        return;
+    }
+    end = skip_json(p) - 1;
+    SDL_strlcpy(dst, p + 1, SDL_min((size_t)(end - p), size));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static layer_t *add_layer() {
+    layer_t                 *layer;
+    size_t                  chunks = (size_t)map_cols * map_rows;
+
+    if (num_layers == MAX_LAYERS)
+        panic("%s has more than %d groups!", map_file, MAX_LAYERS);
+    if (((layer = SDL_calloc(1, sizeof(layer_t))) == NULL) ||
+        ((layer->tiles = SDL_calloc(chunks, MAP_CHUNK_SIZE * MAP_CHUNK_SIZE)) == NULL) ||
+        ((layer->codes = SDL_calloc(chunks, MAP_CHUNK_SIZE * MAP_CHUNK_SIZE)) == NULL) ||
+        ((layer->offsets = SDL_calloc(chunks, sizeof(Uint32))) == NULL) ||
+        ((layer->sizes = SDL_calloc(chunks, sizeof(Uint32))) == NULL))
+        panic("SDL_calloc() failed!");
+    layers[num_layers++] = layer;
+    return layer;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void check_layer(const layer_t *layer) {
+    if ((layer->tiles_src == NULL) || (layer->codes_src == NULL))
+        panic("%s: group %s needs a Tiles and a Codes layer!", map_file, layer->name);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void find_json_layers() {
+    const char              *group, *child, *data;
+    char                    name[64];
+    layer_t                 *layer;
+
+    /* one group per map layer, holding a Tiles and a Codes layer */
+    for (group = first_element(find_member(map_source, "layers")); group != NULL; group = next_element(group)) {
+        layer = add_layer();
+        copy_string(find_member(group, "name"), layer->name, sizeof(layer->name));
+        for (child = first_element(find_member(group, "layers")); child != NULL; child = next_element(child)) {
+            copy_string(find_member(child, "name"), name, sizeof(name));
+            if ((data = find_member(child, "data")) == NULL)
+                continue;
+            if (*data != '[')
+                panic("%s: layer %s/%s is compressed, export it as CSV!", map_file, layer->name, name);
+            if (SDL_strcmp(name, "Tiles") == 0) {
+                layer->tiles_src = data;
+                layer->tiles_len = (size_t)(skip_json(data) - data);
+            } else if (SDL_strcmp(name, "Codes") == 0) {
+                layer->codes_src = data;
+                layer->codes_len = (size_t)(skip_json(data) - data);
+            }
+        }
+        check_layer(layer);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int find_attribute(const char *tag, const char *name, char *dst, size_t size) {
+    const char              *end = SDL_strchr(tag, '>'), *p, *q;
+    size_t                  len = SDL_strlen(name);
+
+    for (p = tag; (p = SDL_strstr(p, name)) != NULL && (end != NULL) && (p < end); p += len) {
+        if (!SDL_isspace((unsigned char)p[-1]) || (SDL_strncmp(p + len, "=\"", 2) != 0))
+            continue;
+        p += len + 2;
+        if ((q = SDL_strchr(p, '"')) == NULL)
+            break;
+        SDL_strlcpy(dst, p, SDL_min((size_t)(q - p) + 1, size));
+        return 1;
+    }
+    SDL_strlcpy(dst, "?", size);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void find_map_size(int tmx) {
+    const char              *p;
+    char                    value[16];
+
+    /* whole chunks only, the game wraps around at the edges with a mask */
+    if (tmx && ((p = SDL_strstr(map_source, "<map")) != NULL)) {
+        if (find_attribute(p, "width", value, sizeof(value)))
+            map_width = SDL_atoi(value);
+        if (find_attribute(p, "height", value, sizeof(value)))
+            map_height = SDL_atoi(value);
+    } else if (!tmx) {
+        if ((p = find_member(map_source, "width")) != NULL)
+            map_width = SDL_atoi(p);
+        if ((p = find_member(map_source, "height")) != NULL)
+            map_height = SDL_atoi(p);
+    }
+    if ((map_width < 1) || (map_width > MAX_MAP_SIZE) || (map_height < 1) || (map_height > MAX_MAP_SIZE) ||
+        (map_width % MAP_CHUNK_SIZE != 0) || (map_height % MAP_CHUNK_SIZE != 0))
+        panic("%s is %dx%d tiles, it needs multiples of %d up to %d!", map_file, map_width, map_height, MAP_CHUNK_SIZE, MAX_MAP_SIZE);
+    map_cols = map_width / MAP_CHUNK_SIZE;
+    map_rows = map_height / MAP_CHUNK_SIZE;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void find_tmx_layers() {
+    const char              *group, *end, *child, *data, *close;
+    char                    name[64], encoding[16];
+    layer_t                 *layer;
+
+    /* Tiled writes one element per line, so plain string search will do */
+    for (group = SDL_strstr(map_source, "<group"); group != NULL; group = SDL_strstr(end, "<group")) {
+        if ((end = SDL_strstr(group, "</group>")) == NULL)
+            panic("%s: group is not closed!", map_file);
+        layer = add_layer();
+        find_attribute(group, "name", layer->name, sizeof(layer->name));
+        for (child = SDL_strstr(group, "<layer"); (child != NULL) && (child < end); child = SDL_strstr(child + 1, "<layer")) {
+            find_attribute(child, "name", name, sizeof(name));
+            if (((data = SDL_strstr(child, "<data")) == NULL) || (data > end))
+                continue;
+            if (!find_attribute(data, "encoding", encoding, sizeof(encoding)) || (SDL_strcmp(encoding, "csv") != 0))
+                panic("%s: layer %s/%s is not CSV encoded!", map_file, layer->name, name);
+            data = SDL_strchr(data, '>') + 1;
+            if ((close = SDL_strstr(data, "</data>")) == NULL)
+                panic("%s: layer %s/%s is not closed!", map_file, layer->name, name);
+            if (SDL_strcmp(name, "Tiles") == 0) {
+                layer->tiles_src = data;
+                layer->tiles_len = (size_t)(close - data);
+            } else if (SDL_strcmp(name, "Codes") == 0) {
+                layer->codes_src = data;
+                layer->codes_len = (size_t)(close - data);
+            }
+        }
+        check_layer(layer);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void parse_plane(const layer_t *layer, const char *src, size_t len, const char *plane, Uint8 *dst) {
+    const char              *end = src + len;
+    char                    *next;
+    unsigned long           id;
+    int                     count = 0, size = map_width * map_height;
+
+    /* a JSON array or CSV text, both are numbers between commas */
+    if (*src == '[')
+        ++src;
+    for (src = skip_space(src); (src < end) && (*src != ']'); src = skip_space(src)) {
+        if (!SDL_isdigit((unsigned char)*src))
+            panic("%s: layer %s/%s has garbage after %d tiles!", map_file, layer->name, plane, count);
+        id = SDL_strtoul(src, &next, 10);
+        if (count == size)
+            panic("%s: layer %s/%s has more than %d tiles!", map_file, layer->name, plane, size);
+        /* Tiled counts from 1, 0 is no tile; flipped tiles set the high bits */
+        if (id > NUM_TILES)
+            panic("%s: layer %s/%s has tile id %lu at %d,%d, only %d exist!", map_file, layer->name, plane,
+                id, count % map_width, count / map_width, NUM_TILES);
+        dst[count++] = (Uint8)(id > 0 ? id - 1 : 0);
+        if (*(src = skip_space(next)) == ',')
+            ++src;
+    }
+    if (count != size)
+        panic("%s: layer %s/%s has %d tiles, expected %d!", map_file, layer->name, plane, count, size);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void pack_chunks(layer_t *layer) {
+    Uint8                   raw[MAP_CHUNK_BYTES];
+    size_t                  start;
+    int                     i, cx, cy, row, offset;
+
+    /* 32x32 map chunks (tiles, then codes), each RLE packed on its own */
+    for (i = 0; i < map_cols * map_rows; ++i) {
+        cx = i % map_cols;
+        cy = i / map_cols;
+        for (row = 0; row < MAP_CHUNK_SIZE; ++row) {
+            offset = (cy * MAP_CHUNK_SIZE + row) * map_width + cx * MAP_CHUNK_SIZE;
+            SDL_memcpy(&raw[row * MAP_CHUNK_SIZE], &layer->tiles[offset], MAP_CHUNK_SIZE);
+            SDL_memcpy(&raw[(MAP_CHUNK_SIZE + row) * MAP_CHUNK_SIZE], &layer->codes[offset], MAP_CHUNK_SIZE);
+        }
+        for (offset = 0; (offset < MAP_CHUNK_BYTES) && (raw[offset] == 0); ++offset);
+        if (offset == MAP_CHUNK_BYTES)
+            continue;   /* empty chunks take no space */
+
+        start = layer->packed.size;
+        pack_rle(&layer->packed, raw, MAP_CHUNK_BYTES);
+        if (layer->packed.size - start >= MAP_CHUNK_BYTES) {
+            layer->packed.size = start;
+            put_bytes(&layer->packed, raw, MAP_CHUNK_BYTES);
+        }
+        layer->offsets[i] = (Uint32)start;
+        layer->sizes[i] = (Uint32)(layer->packed.size - start);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void find_spawns(layer_t *layer, int z) {
+    Uint8                   code;
+    int                     x, y;
+
+    /* in the order scan_spawn_codes() in src/xarax.c finds them, so the ids match */
+    for (y = 0; y < map_height; ++y) {
+        for (x = 0; x < map_width; ++x) {
+            code = layer->codes[y * map_width + x];
+            if (code == TILE_SIGNAL_TILE) {
+                ++x;
+            } else if (tile_flags[code] & TILE_IS_SPAWN) {
+                put_u8(&layer->spawns, code);
+                put_le16(&layer->spawns, x);
+                put_le16(&layer->spawns, y);
+                put_u8(&layer->spawns, z);
+            }
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int reuse_chunks(layer_t *layer, int z) {
+    const Uint8             *entry;
+    Uint32                  i, count, chunks, offset, size, section_size;
+
+    if ((old.chunks == NULL) || ((Uint32)z >= old.num_hashes) || (read_le64(old.hashes + 8 * z) != layer->hash))
+        return 0;
+    count = read_le16(old.chunks);
+    chunks = map_cols * map_rows;
+    if ((z >= (int)count) || (read_le16(old.chunks + 2) != MAP_CHUNK_SIZE) ||
+        (read_le16(old.chunks + 4) != (Uint32)map_cols) || (read_le16(old.chunks + 6) != (Uint32)map_rows))
+        return 0;
+
+    /* the chunks are copied as they are, the index moves along with them */
+    section_size = 8 + count * chunks * 8;
+    for (i = 0; i < chunks; ++i) {
+        entry = old.chunks + 8 + (z * chunks + i) * 8;
+        offset = read_le32(entry);
+        size = read_le32(entry + 4);
+        if (size == 0) {
+            layer->sizes[i] = 0;
+            continue;
+        }
+        if ((size > MAP_CHUNK_BYTES) || (offset < section_size) ||
+            (old.chunks + offset + size > old.data + old.size)) {
+            layer->packed.size = 0;
+            SDL_memset(layer->sizes, 0, chunks * sizeof(Uint32));
+            return 0;
+        }
+        layer->offsets[i] = (Uint32)layer->packed.size;
+        layer->sizes[i] = size;
+        put_bytes(&layer->packed, old.chunks + offset, size);
+    }
+    for (i = 0; i < old.spawns_size; i += 6)
+        if (old.spawns[i + 5] == z)
+            put_bytes(&layer->spawns, old.spawns + i, 6);
+    return 1;
+}
+
+
+/*
+================================================================================
+
+        STRINGS
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static void parse_strings() {
+    const char              *p, *end, *eol, *last;
+    char                    *next;
+    long                    xyz[3], limits[3];
+    int                     i, line, open = 0, first = 1, count = 0;
+
+    limits[0] = map_width;
+    limits[1] = map_height;
+    limits[2] = MAX_LAYERS;
+
+    /* a NUL first, so offset 0 is the empty string */
+    text.size = info.size = 0;
+    put_u8(&text, 0);
+
+    for (p = strings_source, end = p + strings_size, line = 1; p < end; p = eol + 1, ++line) {
+        if ((eol = SDL_strchr(p, '\n')) == NULL)
+            eol = end;
+        for (last = eol; (last > p) && SDL_isspace((unsigned char)last[-1]); --last);
+
+        if (*p == '!') {
+            /* !x y z starts a string */
+            if (open)
+                panic("%s:%d: string before it is not closed with a '.'!", strings_file, line);
+            for (next = (char*)p + 1, i = 0; i < 3; ++i) {
+                xyz[i] = SDL_strtol(next, &next, 10);
+                if ((xyz[i] < 0) || (xyz[i] >= limits[i]))
+                    panic("%s:%d: coordinate %ld is out of range!", strings_file, line, xyz[i]);
+            }
+            if (++count > NUM_STRINGS)
+                panic("%s:%d: more than %d strings!", strings_file, line, NUM_STRINGS);
+            if (text.size >= TEXT_DATA_SIZE)
+                panic("%s:%d: text is larger than %d bytes!", strings_file, line, TEXT_DATA_SIZE);
+            if (legacy) {
+                put_u8(&info, xyz[0]);
+                put_u8(&info, xyz[1]);
+            } else {
+                put_le16(&info, xyz[0]);
+                put_le16(&info, xyz[1]);
+            }
+            put_u8(&info, xyz[2]);
+            put_le16(&info, (Uint32)text.size);
+            open = first = 1;
+        } else if (*p == '.') {
+            /* a lone dot ends it */
+            if (open)
+                put_u8(&text, 0);
+            open = 0;
+        } else if (open) {
+            /* lines are joined with newlines, trailing blanks are dropped */
+            if (!first)
+                put_u8(&text, '\n');
+            for (; p < last; ++p) {
+                if ((Uint8)*p >= 0x80)
+                    panic("%s:%d: only ASCII text is supported!", strings_file, line);
+                put_u8(&text, *p);
+            }
+            first = 0;
+        }
+    }
+    if (open)
+        panic("%s: last string is not closed with a '.'!", strings_file);
+    if (text.size > TEXT_DATA_SIZE)
+        panic("%s: text is larger than %d bytes!", strings_file, TEXT_DATA_SIZE);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int reuse_strings() {
+    if ((old.hashes == NULL) || (old.text == NULL) || (old.info == NULL) ||
+        (read_le64(old.hashes + 8 * old.num_hashes) != text_hash))
+        return 0;
+    put_bytes(&text, old.text, old.text_size);
+    put_bytes(&info, old.info, old.info_size);
+    return 1;
+}
+
+
+/*
+================================================================================
+
+        OUTPUT
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static const Uint8 *find_old_section(const char *tag, Uint32 *size) {
+    const Uint8             *entry;
+    Uint32                  i, count, offset;
+
+    count = read_le16(old.data + 6);
+    for (i = 0, entry = old.data + WORLD_HEADER_SIZE; i < count; ++i, entry += WORLD_ENTRY_SIZE) {
+        if ((entry + WORLD_ENTRY_SIZE > old.data + old.size) || (SDL_memcmp(entry, tag, 4) != 0))
+            continue;
+        offset = read_le32(entry + 8);
+        *size = read_le32(entry + 12);
+        if ((read_le32(entry + 4) != WORLD_PACK_RAW) || (offset > old.size) || (*size > old.size - offset))
+            return NULL;
+        return old.data + offset;
+    }
+    return NULL;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void read_old_world() {
+    Uint32                  size;
+
+    /* a missing, legacy or foreign file just means a full build */
+    if (full_build || legacy || ((old.data = SDL_LoadFile(out_file, &old.size)) == NULL))
+        return;
+    if ((old.size < WORLD_HEADER_SIZE) || (SDL_memcmp(old.data, WORLD_MAGIC, 4) != 0) ||
+        (read_le16(old.data + 4) != WORLD_VERSION))
+        return;
+    if (((old.hashes = find_old_section("HASH", &size)) == NULL) || (size < 2))
+        return;
+    old.num_hashes = read_le16(old.hashes);
+    old.hashes += 2;
+    if (size != 2 + 8 * (old.num_hashes + 1)) {
+        old.hashes = NULL;
+        return;
+    }
+    old.chunks = find_old_section("CHNK", &size);
+    if ((old.chunks != NULL) && ((size < 8) || (size < 8 + read_le16(old.chunks) * read_le16(old.chunks + 4) * read_le16(old.chunks + 6) * 8)))
+        old.chunks = NULL;
+    if (((old.spawns = find_old_section("SPWN", &old.spawns_size)) == NULL) || (old.spawns_size % 6 != 0))
+        old.chunks = NULL;  /* the chunks are no use without their spawns */
+    old.text = find_old_section("TEXT", &old.text_size);
+    old.info = find_old_section("INFO", &old.info_size);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void seed_source_hashes() {
+    Uint8                   spawns[NUM_TILES], version = BAKE_VERSION;
+    Uint16                  size[2];
+    int                     i;
+
+    /* old output is only reused if this baker would write the same bytes for it */
+    for (i = 0; i < NUM_TILES; ++i)
+        spawns[i] = tile_flags[i] & TILE_IS_SPAWN;
+    size[0] = (Uint16)map_width; size[1] = (Uint16)map_height;
+    source_seed = hash_bytes(hash_bytes(HASH_SEED, &version, 1), spawns, sizeof(spawns));
+    source_seed = hash_bytes(source_seed, size, sizeof(size));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_job(int job) {
+    layer_t                 *layer;
+
+    /* job 0 is the text, every other job one map layer */
+    if (job == 0) {
+        text_hash = hash_bytes(source_seed, strings_source, strings_size);
+        if (!(text_reused = reuse_strings()))
+            parse_strings();
+        return;
+    }
+    layer = layers[job - 1];
+    layer->hash = hash_bytes(hash_bytes(source_seed, layer->tiles_src, layer->tiles_len), layer->codes_src, layer->codes_len);
+    if (!legacy && (layer->reused = reuse_chunks(layer, job - 1)))
+        return;
+    parse_plane(layer, layer->tiles_src, layer->tiles_len, "Tiles", layer->tiles);
+    parse_plane(layer, layer->codes_src, layer->codes_len, "Codes", layer->codes);
+    if (!legacy) {
+        pack_chunks(layer);
+        find_spawns(layer, job - 1);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int run_jobs(void *data) {
+    int                     job;
+
+    (void)data;
+    while ((job = SDL_AtomicAdd(&next_job, 1)) <= num_layers)
+        run_job(job);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_stages() {
+    SDL_Thread              *threads[64];
+    int                     i, count;
+
+    /* the text and every layer are independent, one worker per core */
+    count = SDL_min(SDL_min(SDL_GetCPUCount(), num_layers + 1), (int)SDL_arraysize(threads) + 1) - 1;
+    for (i = 0; i < count; ++i)
+        if ((threads[i] = SDL_CreateThread(run_jobs, "bake", NULL)) == NULL)
+            panic("SDL_CreateThread() failed: %s", SDL_GetError());
+    run_jobs(NULL);
+    for (i = 0; i < count; ++i)
+        SDL_WaitThread(threads[i], NULL);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void build_chunks(buffer_t *out) {
+    const layer_t           *layer;
+    Uint32                  base;
+    int                     z, i;
+
+    /* LE16 layers, chunk size, columns and rows, LE32 offset and size per chunk, then the chunks */
+    put_le16(out, num_layers);
+    put_le16(out, MAP_CHUNK_SIZE);
+    put_le16(out, map_cols);
+    put_le16(out, map_rows);
+    base = 8 + num_layers * map_cols * map_rows * 8;
+    for (z = 0; z < num_layers; ++z) {
+        layer = layers[z];
+        for (i = 0; i < map_cols * map_rows; ++i) {
+            put_le32(out, layer->sizes[i] > 0 ? base + layer->offsets[i] : 0);
+            put_le32(out, layer->sizes[i]);
+        }
+        base += (Uint32)layer->packed.size;
+    }
+    for (z = 0; z < num_layers; ++z)
+        put_bytes(out, layers[z]->packed.data, layers[z]->packed.size);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void write_sections(buffer_t *out) {
+    buffer_t                sections[5];
+    const char              *tags[5] = { "CHNK", "SPWN", "TEXT", "INFO", "HASH" };
+    Uint32                  offset;
+    int                     i;
+
+    SDL_zero(sections);
+    build_chunks(&sections[0]);
+    for (i = 0; i < num_layers; ++i)
+        put_bytes(&sections[1], layers[i]->spawns.data, layers[i]->spawns.size);
+    put_bytes(&sections[2], text.data, text.size);
+    put_bytes(&sections[3], info.data, info.size);
+    put_le16(&sections[4], num_layers);
+    for (i = 0; i < num_layers; ++i)
+        put_le64(&sections[4], layers[i]->hash);
+    put_le64(&sections[4], text_hash);
+
+    /* header, section directory, then the section bodies without padding */
+    put_bytes(out, WORLD_MAGIC, 4);
+    put_le16(out, WORLD_VERSION);
+    put_le16(out, SDL_arraysize(tags));
+    offset = WORLD_HEADER_SIZE + SDL_arraysize(tags) * WORLD_ENTRY_SIZE;
+    for (i = 0; i < (int)SDL_arraysize(tags); ++i) {
+        put_bytes(out, tags[i], 4);
+        put_le32(out, WORLD_PACK_RAW);
+        put_le32(out, offset);
+        put_le32(out, (Uint32)sections[i].size);
+        put_le32(out, (Uint32)sections[i].size);
+        offset += (Uint32)sections[i].size;
+    }
+    for (i = 0; i < (int)SDL_arraysize(tags); ++i) {
+        put_bytes(out, sections[i].data, sections[i].size);
+        printf("%s %u\n", tags[i], (unsigned)sections[i].size);
+        SDL_free(sections[i].data);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void write_legacy(buffer_t *out) {
+    int                     z;
+
+    /* the old fixed layout with all its padding */
+    if ((num_layers != 2) || (map_width != LEGACY_MAP_SIZE) || (map_height != LEGACY_MAP_SIZE))
+        panic("The legacy layout needs exactly 2 layers of %dx%d, %s has %d of %dx%d!",
+            LEGACY_MAP_SIZE, LEGACY_MAP_SIZE, map_file, num_layers, map_width, map_height);
+    for (z = 0; z < 2; ++z)
+        put_bytes(out, layers[z]->tiles, LEGACY_MAP_SIZE * LEGACY_MAP_SIZE);
+    for (z = 0; z < 2; ++z)
+        put_bytes(out, layers[z]->codes, LEGACY_MAP_SIZE * LEGACY_MAP_SIZE);
+    put_bytes(out, text.data, text.size);
+    while (out->size < 4 * LEGACY_MAP_SIZE * LEGACY_MAP_SIZE + TEXT_DATA_SIZE)
+        put_u8(out, 0);
+    put_bytes(out, info.data, info.size);
+    while (out->size < 4 * LEGACY_MAP_SIZE * LEGACY_MAP_SIZE + TEXT_DATA_SIZE + NUM_STRINGS * LEGACY_INFO_SIZE)
+        put_u8(out, 0);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void write_world(const buffer_t *out) {
+    char                    tmp[1024];
+    SDL_RWops               *rw;
+
+    /* replace the file in one step, a running game may have it mapped */
+    SDL_snprintf(tmp, sizeof(tmp), "%s.tmp", out_file);
+    if ((rw = SDL_RWFromFile(tmp, "wb")) == NULL)
+        panic("SDL_RWFromFile() failed: %s", SDL_GetError());
+    if (SDL_RWwrite(rw, out->data, out->size, 1) != 1)
+        panic("SDL_RWwrite() failed: %s", SDL_GetError());
+    SDL_RWclose(rw);
+    if (rename(tmp, out_file) != 0)
+        panic("Can't replace %s!", out_file);
+}
+
+
+/*
+================================================================================
+
+        MAIN
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static void parse_arguments(int argc, char **argv) {
+    int                     i;
+
+    for (i = 1; i < argc; ++i) {
+        if (SDL_strcmp(argv[i], "-legacy") == 0)
+            legacy = 1;
+        else if (SDL_strcmp(argv[i], "-full") == 0)
+            full_build = 1;
+        else if ((SDL_strcmp(argv[i], "-map") == 0) && (i + 1 < argc))
+            map_file = argv[++i];
+        else if ((SDL_strcmp(argv[i], "-strings") == 0) && (i + 1 < argc))
+            strings_file = argv[++i];
+        else if ((SDL_strcmp(argv[i], "-o") == 0) && (i + 1 < argc))
+            out_file = argv[++i];
+        else
+            panic("Unknown argument: %s", argv[i]);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+int main(int argc, char **argv) {
+    buffer_t                out;
+    Uint64                  start;
+    size_t                  len;
+    int                     i, reused, tmx;
+
+    start = SDL_GetPerformanceCounter();
+    parse_arguments(argc, argv);
+
+    /* SDL_LoadFile() terminates the data, the parsers rely on that */
+    if ((map_source = SDL_LoadFile(map_file, &len)) == NULL)
+        panic("SDL_LoadFile() failed: %s", SDL_GetError());
+    if ((strings_source = SDL_LoadFile(strings_file, &strings_size)) == NULL)
+        panic("SDL_LoadFile() failed: %s", SDL_GetError());
+    read_old_world();
+
+    len = SDL_strlen(map_file);
+    tmx = (len > 4) && (SDL_strcmp(map_file + len - 4, ".tmx") == 0);
+    find_map_size(tmx);
+    seed_source_hashes();
+    if (tmx)
+        find_tmx_layers();
+    else
+        find_json_layers();
+    if (num_layers == 0)
+        panic("%s has no layer groups!", map_file);
+    run_stages();
+
+    SDL_zero(out);
+    if (legacy)
+        write_legacy(&out);
+    else
+        write_sections(&out);
+    write_world(&out);
+
+    for (reused = i = 0; i < num_layers; ++i)
+        reused += layers[i]->reused;
+    printf("%s: %u bytes, %d of %d layers%s reused, %.1f ms\n", out_file, (unsigned)out.size, reused, num_layers,
+        text_reused ? " and the text" : "", (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency());
+    return 0;
+}
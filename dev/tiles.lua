@@ -0,0 +1,65 @@
+-- prints src/tile_flags.h, the tile classes and one entry per tile of
+-- tiles.bmp; `make` runs it whenever this file changes
+local flags = {
+    -- name         bit     comment
+    { 'FLOOR',      0x01,   'walkable' },
+    { 'ANIMATED',   0x02,   'alternates with the next tile' },
+    { 'MONSTER',    0x04 },
+    { 'AVATAR',     0x08 },
+    { 'SPAWN',      0x10,   'becomes an object on load' },
+    { 'WIRE',       0x20 },
+    { 'INTERACTIVE',0x40,   'reacts to the avatar walking into it' },
+    { 'LIGHT',      0x80,   'lights its surroundings' },
+}
+
+local classes = {
+    -- flag         first   last
+    { 'FLOOR',      0x80,   0x8f },
+    { 'ANIMATED',   0xa0,   0xaf },
+    { 'INTERACTIVE',0xa0,   0xa0 },     -- fire place
+    { 'LIGHT',      0xa0,   0xa0 },
+    { 'SPAWN',      0xb0,   0xb2 },     -- doors
+    { 'INTERACTIVE',0xb3,   0xb3 },     -- sign post
+    { 'SPAWN',      0xb6,   0xb6 },     -- closed chest
+    { 'INTERACTIVE',0xb8,   0xb8 },     -- dock
+    { 'SPAWN',      0xba,   0xba },     -- flag
+    { 'AVATAR',     0xc0,   0xc1 },
+    { 'SPAWN',      0xc0,   0xc1 },
+    { 'INTERACTIVE',0xc2,   0xcb },     -- tavern, healer, smith, story
+    { 'MONSTER',    0xd0,   0xdf },
+    { 'SPAWN',      0xd0,   0xdf },
+    { 'WIRE',       0xf0,   0xf1 },
+}
+
+local bits = {}
+print('/* generated by dev/tiles.lua, shared by src/xarax.c and dev/bake.c */')
+for _, flag in ipairs(flags) do
+    local line = string.format('#define %-20s0x%02x', 'TILE_IS_' .. flag[1], flag[2])
+    if flag[3] then
+        line = line .. '    /* ' .. flag[3] .. ' */'
+    end
+    print(line)
+    bits[flag[1]] = flag[2]
+end
+print('')
+
+local data = {}
+for i = 1, 256 do
+    data[i] = 0
+end
+for _, class in ipairs(classes) do
+    local bit = assert(bits[class[1]], class[1])
+    for id = class[2], class[3] do
+        if math.floor(data[id + 1] / bit) % 2 == 0 then
+            data[id + 1] = data[id + 1] + bit
+        end
+    end
+end
+for i = 1, 256 do
+    data[i] = string.format('0x%02x', data[i])
+end
+print('static const Uint8          tile_flags[256] = {')
+for i = 1, 256, 16 do
+    print('    ' .. table.concat(data, ', ', i, i + 15) .. ',')
+end
+print('};')
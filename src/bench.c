@@ -0,0 +1,364 @@
+/*
+================================================================================
+
+    Xarax - tick throughput benchmarks
+    written by Sebastian Steinhauer <s.steinhauer@yahoo.de>
+
+
+    This is free and unencumbered software released into the public domain.
+
+    For more information, please refer to <https://unlicense.org>
+
+
+================================================================================
+*/
+/*
+================================================================================
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+/* pull in the whole game, so the benchmarks can reach its static functions */
+#define main xarax_main
+#include "xarax.c"
+#undef main
+
+
+/*
+================================================================================
+
+        DEFINES
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+#define MAX_SAMPLES         1000
+
+
+/*----------------------------------------------------------------------------*/
+typedef struct bench_world_t {
+    const char              *name;
+    const char              *file;
+    void                    (*build)();     /* NULL for files on disk */
+} bench_world_t;
+
+typedef struct bench_t {
+    const char              *name;
+    int                     ops;            /* operations per sample */
+    int                     (*setup)();     /* returns 0 if not applicable */
+    void                    (*run)(int op);
+} bench_t;
+
+
+/*
+================================================================================
+
+        GLOBAL VARIABLES
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static int                  num_samples = 100;
+static double               samples[MAX_SAMPLES];
+static Uint16               flag_x, flag_y;
+static Uint8                flag_z;
+static Uint8                tilemap[2][256][256];   /* synthetic worlds */
+static Uint8                codemap[2][256][256];
+static Uint8                no_text[TEXT_DATA_SIZE];
+static Uint8                no_info[NUM_STRINGS * LEGACY_INFO_SIZE];
+
+
+/*
+================================================================================
+
+        SYNTHETIC WORLDS
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static void clear_world() {
+    SDL_zero(tilemap);
+    SDL_zero(codemap);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void fill_floor() {
+    SDL_memset(tilemap, TILE_FLOOR_FIRST, sizeof(tilemap));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void build_monsters() {
+    int                     x, y;
+
+    /* a monster on every floor tile around the avatar until the pool is full */
+    clear_world();
+    fill_floor();
+    for (y = 96; y < 160; ++y)
+        for (x = 96; x < 160; ++x)
+            codemap[0][y][x] = TILE_MONSTER_FIRST + ((x + y) % 16);
+    codemap[0][128][128] = TILE_AVATAR_0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void build_pool() {
+    int                     i;
+
+    /* all object slots allocated, but none of them close to the avatar */
+    clear_world();
+    fill_floor();
+    for (i = 0; i < NUM_OBJECTS - 1; ++i)
+        codemap[i & 1][(i >> 1) & 255][((i >> 9) * 31 + 64) & 255] = TILE_CHEST_CLOSED;
+    codemap[0][128][0] = TILE_AVATAR_0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void build_signals() {
+    int                     x, y, row;
+
+    /* a flag driving one long wire that snakes down the map to a door */
+    clear_world();
+    fill_floor();
+    codemap[0][3][1] = TILE_FLAG_OFF;
+    for (row = 0; row < 64; ++row) {
+        y = 4 + row * 2;
+        for (x = 1; x < 251; ++x)
+            codemap[0][y][x] = TILE_SIGNAL_OFF;
+        codemap[0][y + 1][(row & 1) ? 1 : 250] = TILE_SIGNAL_OFF;
+    }
+    codemap[0][y + 2][1] = TILE_SIGNAL_OR;
+    codemap[0][y + 2][2] = TILE_DOOR_MAGIC;
+    codemap[0][250][128] = TILE_AVATAR_0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void write_world(const char *filename) {
+    SDL_RWops               *rw;
+
+    if ((rw = SDL_RWFromFile(filename, "wb")) == NULL)
+        panic("SDL_RWFromFile() failed: %s", SDL_GetError());
+    if ((SDL_RWwrite(rw, tilemap, sizeof(tilemap), 1) != 1) ||
+        (SDL_RWwrite(rw, codemap, sizeof(codemap), 1) != 1) ||
+        (SDL_RWwrite(rw, no_text, sizeof(no_text), 1) != 1) ||
+        (SDL_RWwrite(rw, no_info, sizeof(no_info), 1) != 1))
+        panic("SDL_RWwrite() failed: %s", SDL_GetError());
+    SDL_RWclose(rw);
+}
+
+
+/*
+================================================================================
+
+        BENCHMARKS
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static int setup_world() {
+    load_world();
+    enter_state(GAME_STATE_PLAY);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int setup_flag() {
+    int                     i;
+
+    setup_world();
+    for (i = 0; i < NUM_OBJECTS; ++i) {
+        if (objects[i].picture == TILE_FLAG_OFF) {
+            flag_x = objects[i].x; flag_y = objects[i].y; flag_z = objects[i].z;
+            find_signal_graph(flag_z);  /* compiled once, not per activation */
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int setup_sail() {
+    setup_world();
+    avatar.sail_x = 1; avatar.sail_y = 0;
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int setup_tavern() {
+    setup_world();
+    enter_state(GAME_STATE_TAVERN);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_play(int op) {
+    /* walk back and forth, so every op is a full turn */
+    btn = (op & 1) ? BUTTON_LEFT : BUTTON_RIGHT;
+    on_game_state_play();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_rest(int op) {
+    (void)op;
+    on_game_state_rest(1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_rest_until_dawn(int op) {
+    (void)op;
+    enter_state(GAME_STATE_REST2);
+    rest_until_dawn(1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_sail(int op) {
+    (void)op;
+    on_game_state_sail();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_tavern(int op) {
+    /* move the cursor, the world behind the menu stays the same */
+    btn = (op & 1) ? BUTTON_UP : BUTTON_DOWN;
+    on_game_state_tavern();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_draw_map(int op) {
+    (void)op;
+    draw_map();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_handle_all_objects(int op) {
+    (void)op;
+    handle_all_objects();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_power_tile(int op) {
+    (void)op;
+    power_tile(flag_x, flag_y, flag_z);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_load_world(int op) {
+    (void)op;
+    load_world();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const bench_world_t  worlds[] = {
+    { "world.dat",  "world.dat",            NULL },
+    { "monsters",   "bench-monsters.dat",   build_monsters },
+    { "pool",       "bench-pool.dat",       build_pool },
+    { "signals",    "bench-signals.dat",    build_signals },
+};
+
+static const bench_t        benchmarks[] = {
+    { "on_game_state_play",     64,     setup_world,    run_play },
+    { "on_game_state_rest",     32,     setup_world,    run_rest },
+    { "rest_until_dawn",        1,      setup_world,    run_rest_until_dawn },
+    { "on_game_state_sail",     64,     setup_sail,     run_sail },
+    { "on_game_state_tavern",   64,     setup_tavern,   run_tavern },
+    { "draw_map",               256,    setup_world,    run_draw_map },
+    { "handle_all_objects",     64,     setup_world,    run_handle_all_objects },
+    { "power_tile",             1,      setup_flag,     run_power_tile },
+    { "load_world",             1,      setup_world,    run_load_world },
+};
+
+
+/*----------------------------------------------------------------------------*/
+static int compare_samples(const void *a, const void *b) {
+    const double            x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static double percentile(double p) {
+    return samples[(int)(p * (num_samples - 1) + 0.5)];
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_benchmark(const bench_world_t *world, const bench_t *bench) {
+    int                     i, op;
+    Uint64                  start, ticks;
+    double                  sum;
+
+    for (sum = 0.0, i = 0; i < num_samples; ++i) {
+        if (!bench->setup())
+            return;
+        start = SDL_GetPerformanceCounter();
+        for (op = 0; op < bench->ops; ++op)
+            bench->run(op);
+        ticks = SDL_GetPerformanceCounter() - start;
+        samples[i] = (double)ticks * 1e9 / SDL_GetPerformanceFrequency() / bench->ops;
+        sum += samples[i];
+    }
+    SDL_qsort(samples, num_samples, sizeof(samples[0]), compare_samples);
+
+    printf("%s,%s,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+        bench->name, world->name, num_samples, bench->ops, sum / num_samples,
+        samples[0], percentile(0.5), percentile(0.9), percentile(0.99), samples[num_samples - 1]);
+    fflush(stdout);
+}
+
+
+/*----------------------------------------------------------------------------*/
+int main(int argc, char **argv) {
+    const bench_world_t     *world;
+    const bench_t           *bench;
+    int                     i;
+
+    headless = 1;
+    for (i = 1; i < argc; ++i) {
+        if ((SDL_strcmp(argv[i], "-samples") == 0) && (i + 1 < argc))
+            num_samples = SDL_atoi(argv[++i]);
+        else
+            panic("Unknown argument: %s", argv[i]);
+    }
+    if ((num_samples < 1) || (num_samples > MAX_SAMPLES))
+        panic("-samples must be between 1 and %d", MAX_SAMPLES);
+    if (SDL_Init(SDL_INIT_TIMER))
+        panic("SDL_Init() failed: %s", SDL_GetError());
+
+    printf("benchmark,world,samples,ops,mean_ns,min_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+    for (world = worlds; world < worlds + SDL_arraysize(worlds); ++world) {
+        if (world->build != NULL) {
+            world->build();
+            write_world(world->file);
+        }
+        world_file = world->file;
+        for (bench = benchmarks; bench < benchmarks + SDL_arraysize(benchmarks); ++bench)
+            run_benchmark(world, bench);
+        if (world->build != NULL)
+            remove(world->file);
+    }
+
+    SDL_Quit();
+    return 0;
+}
+
+
+/*
+================================================================================
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
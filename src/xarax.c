@@ -38,8 +38,22 @@
 ================================================================================
 */
 /*----------------------------------------------------------------------------*/
+#include <stdio.h>
 #include "SDL.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#define HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
 
 /*
 ================================================================================
@@ -54,7 +68,64 @@
 
 #define SCREEN_COLS         32
 #define SCREEN_ROWS         18
-#define SCREEN_SIZE         32      /* must be power of two */
+#define SCREEN_SIZE         32      /* must be power of two, max. 32 */
+#define SCREEN_WIDTH        (SCREEN_COLS * 8)
+#define SCREEN_HEIGHT       (SCREEN_ROWS * 8)
+
+#define TILES_SIZE          128     /* tiles.bmp is 16x16 tiles of 8x8 */
+
+
+/*----------------------------------------------------------------------------*/
+enum {
+    RENDER_MODE_TEXTURE,            /* compose on CPU, upload one texture */
+    RENDER_MODE_TILES               /* one SDL_RenderCopy() per cell */
+};
+
+
+/*----------------------------------------------------------------------------*/
+typedef struct render_stats_t {
+    Uint32                  frames;         /* frames presented */
+    Uint32                  skipped;        /* frames without any change */
+    Uint32                  last_cells;     /* cells redrawn in the last frame */
+    Uint64                  cells;          /* cells redrawn in total */
+    Uint32                  world_draws;    /* world layer redraws */
+} render_stats_t;
+
+
+/*----------------------------------------------------------------------------*/
+#define SCREEN_LAYER_WORLD      0   /* and 1, one per animation frame */
+#define SCREEN_LAYER_HUD        2
+#define SCREEN_LAYER_OVERLAY    3   /* menus and boxes, redrawn every tick */
+#define SCREEN_LAYER_PROFILE    4
+#define SCREEN_LAYERS           5
+
+typedef struct screen_layer_t {
+    Uint8                   cells[SCREEN_SIZE][SCREEN_SIZE];
+    Uint32                  used[SCREEN_SIZE];  /* one bit per column drawn */
+    int                     valid;          /* 0 = redraw before use */
+} screen_layer_t;
+
+
+/*----------------------------------------------------------------------------*/
+enum {
+    FRAME_PACING_SLEEP,             /* wait for events until the next tick */
+    FRAME_PACING_SPIN               /* poll in a tight loop, rely on vsync */
+};
+
+typedef struct pacing_stats_t {
+    Uint32                  ticks;
+    double                  min, max;       /* tick interval in ms */
+    double                  sum, sum_sq;
+    double                  idle, total;    /* time spent waiting / running */
+    Uint64                  start, last;
+} pacing_stats_t;
+
+typedef struct load_stats_t {
+    Uint32                  loads;
+    double                  startup;        /* main() until the first tick, in ms */
+    double                  first, last;    /* load_world() time, in ms */
+    double                  min, max;       /* ... of the reloads only */
+} load_stats_t;
 
 
 /*----------------------------------------------------------------------------*/
@@ -68,9 +139,30 @@ enum {
     GAME_STATE_HEALER,
     GAME_STATE_SMITH,
     GAME_STATE_STORY,
-    GAME_STATE_QUESTION
+    GAME_STATE_QUESTION,
+    GAME_STATES
+};
+
+
+/*----------------------------------------------------------------------------*/
+#define PROFILE_FRAMES      256     /* frames kept in the ring buffer */
+
+enum {
+    PROFILE_EVENTS,
+    PROFILE_TICK,                   /* includes the phases below but render */
+    PROFILE_DRAW_MAP,
+    PROFILE_OBJECTS,
+    PROFILE_POWER,
+    PROFILE_RENDER,
+    PROFILE_PHASES
 };
 
+typedef struct profile_frame_t {
+    double                  ms[PROFILE_PHASES];
+    double                  state_ms[GAME_STATES];  /* PROFILE_TICK per state */
+    Uint32                  ticks;
+} profile_frame_t;
+
 
 /*----------------------------------------------------------------------------*/
 enum {
@@ -156,16 +248,88 @@ enum {
 
 
 /*----------------------------------------------------------------------------*/
-#define NUM_OBJECTS         4096
+#define NUM_OBJECTS         4096    /* multiple of 64, max. 4096 */
 
 typedef struct object_t {
     Uint16                  id;
+    Uint16                  x, y;           /* no padding, objects are hashed and compared as bytes */
+    Uint16                  spawn_x, spawn_y;
+    Uint8                   z, spawn_z;
     Uint8                   picture;
-    Uint8                   x, y, z;
-    Uint8                   spawn_x, spawn_y, spawn_z;
     Uint8                   life;
 } object_t;
 
+#define ACTIVATION_RADIUS   8       /* monsters act this close to the avatar */
+#define FIELD_SIZE          (ACTIVATION_RADIUS * 2 + 1)
+#define FIELD_STRIDE        (FIELD_SIZE + 2)    /* with a wall all around */
+#define FIELD_FAR           0xfe    /* no way to the avatar within the radius */
+#define FIELD_WALL          0xff
+
+#define CHUNK_SHIFT         3       /* 8x8 tiles per chunk */
+#define NO_OBJECT           0xffff
+
+
+/*----------------------------------------------------------------------------*/
+#define MAP_CHUNK_SHIFT     5       /* 32x32 tiles per map chunk */
+#define MAP_CHUNK_SIZE      (1 << MAP_CHUNK_SHIFT)
+#define MAP_CHUNK_MASK      (MAP_CHUNK_SIZE - 1)
+#define MAP_CHUNK_BYTES     (2 * MAP_CHUNK_SIZE * MAP_CHUNK_SIZE)  /* tiles + codes on disk */
+#define MAP_RESIDENT_CHUNKS 256     /* soft limit, pinned chunks may exceed it */
+#define MAX_LAYERS          256
+#define MAX_MAP_SIZE        2048    /* tiles per side, a multiple of MAP_CHUNK_SIZE */
+#define LEGACY_MAP_SIZE     256     /* before world version 3 */
+
+typedef Uint16 obj_plane_t[MAP_CHUNK_SIZE][MAP_CHUNK_SIZE];     /* object id + 1 */
+
+typedef struct map_chunk_t {
+    Uint8                   tiles[MAP_CHUNK_SIZE][MAP_CHUNK_SIZE];
+    Uint8                   codes[MAP_CHUNK_SIZE][MAP_CHUNK_SIZE];
+    Uint16                  (*objs)[MAP_CHUNK_SIZE];    /* no_objs while it holds none */
+    struct map_chunk_t      **slot;         /* NULL if the chunk is free */
+    Uint32                  used;           /* map_clock of the last load, write or visit */
+    Uint16                  num_objs;
+    int                     dirty;          /* tiles or codes differ from the file */
+} map_chunk_t;
+
+typedef struct signal_net_t {
+    Uint32                  first_cell, num_cells;  /* in signal_graph_t.cells */
+    Uint32                  first_out, num_outs;    /* in signal_graph_t.outs */
+    Uint32                  pulse;          /* last power_tile() that reached it */
+} signal_net_t;
+
+typedef struct signal_graph_t {
+    Uint32                  *wires;         /* y << 16 | x of every wire, sorted */
+    Uint32                  *net_of;        /* net of each wire */
+    Uint32                  *cells;         /* the wires again, grouped by net */
+    Uint32                  *outs;          /* cells next to a net that may react to it */
+    signal_net_t            *nets;
+    Uint32                  num_wires, num_nets, num_outs;
+    int                     stale;          /* a code changed its signal_role() since */
+} signal_graph_t;
+
+typedef struct map_layer_t {
+    Uint16                  *heads;         /* objects per chunk, NULL until the first one */
+    signal_graph_t          *signals;       /* NULL until power_tile() needs it */
+} map_layer_t;
+
+typedef struct map_stats_t {
+    Uint32                  loads, evictions;
+    Uint32                  resident, peak;
+    Uint32                  obj_planes;     /* allocated, in use or spare */
+} map_stats_t;
+
+typedef struct signal_stats_t {
+    Uint32                  activations;
+    Uint32                  last_visited;   /* cells visited by the last one */
+    Uint32                  max_visited;
+    Uint64                  total_visited;
+} signal_stats_t;
+
+typedef struct object_list_t {
+    int                     count;
+    Uint16                  ids[NUM_OBJECTS];   /* ascending object ids */
+} object_list_t;
+
 typedef struct avatar_t {
     object_t                *obj;
     Uint8                   money, keys, torch, time;
@@ -179,15 +343,90 @@ typedef struct avatar_t {
 
 /*----------------------------------------------------------------------------*/
 #define NUM_STRINGS         4096
+#define TEXT_DATA_SIZE      (1 << 16)
+#define INFO_ENTRY_SIZE     7       /* LE16 x, LE16 y, z, LE16 offset */
+#define LEGACY_INFO_SIZE    5       /* x, y, z, LE16 offset before world version 3 */
+#define TEXT_INFO_SIZE      (NUM_STRINGS * INFO_ENTRY_SIZE)
+#define LEGACY_WORLD_SIZE   (2 * 2 * 256 * 256 + TEXT_DATA_SIZE + NUM_STRINGS * LEGACY_INFO_SIZE)
+
+#define WORLD_MAGIC         "XWLD"
+#define WORLD_VERSION       3       /* 2 is still read, its maps are 256x256 */
+#define WORLD_HEADER_SIZE   8       /* magic, LE16 version, LE16 sections */
+#define WORLD_ENTRY_SIZE    20      /* tag, LE32 pack, offset, size, raw size */
+#define SPAWN_ENTRY_SIZE    6       /* picture, LE16 x, LE16 y, z */
+#define LEGACY_SPAWN_SIZE   4       /* picture, x, y, z before world version 3 */
+
+#define SAVE_MAGIC          "XSAV"
+#define SAVE_VERSION        2
+#define SAVE_HEADER_SIZE    9       /* magic, version, LE32 world hash */
+#define SAVE_AVATAR_SIZE    16
+#define SAVE_OBJECT_SIZE    15      /* LE16 id, object fields, on map */
+#define SAVE_RUN_MAX        255
+
+#define RELOAD_DELAY        100     /* ms without changes before reloading */
+#define RELOAD_WORLD        1
+#define RELOAD_TILES        2
+
+typedef struct chunk_edit_t {
+    int                     cx, cy, z;
+    Uint8                   pristine[MAP_CHUNK_BYTES];
+    Uint8                   data[MAP_CHUNK_BYTES];
+} chunk_edit_t;
+
+typedef struct world_state_t {
+    object_t                objects[NUM_OBJECTS];
+    object_t                pristine[NUM_OBJECTS];
+    Uint8                   on_map[NUM_OBJECTS];
+    Uint8                   hurt_states[NUM_OBJECTS];
+    avatar_t                avatar;
+    int                     width, height;  /* of the map */
+    int                     num_edits;
+    chunk_edit_t            *edits;
+} world_state_t;
 
 typedef struct text_info_t {
-    Uint8                   x, y, z;
+    Uint16                  x, y;
+    Uint8                   z;
     Uint16                  offset;
 } text_info_t;
 
+enum {
+    WORLD_PACK_RAW,                 /* stored as is */
+    WORLD_PACK_RLE                  /* see unpack_rle() */
+};
+
+typedef struct world_section_t {
+    const Uint8             *data;          /* points into world_data */
+    Uint32                  pack, size, raw_size;
+} world_section_t;
+
+typedef struct text_range_t {
+    Uint32                  key;            /* TEXT_KEY(), TEXT_NO_KEY if unused */
+    Uint32                  first, count;   /* pages in text_pages */
+} text_range_t;
+
+#define TEXT_KEY(x, y, z)   (((Uint32)(z) << 22) | ((Uint32)(y) << 11) | (Uint32)(x))
+#define TEXT_NO_KEY         0xffffffff
+
 
 /*----------------------------------------------------------------------------*/
 #define TORCH_LIGHT_RADIUS  6
+#define FIRE_LIGHT_RADIUS   3
+#define VIEW_ROWS           (SCREEN_ROWS - 1)   /* below the HUD row */
+
+typedef struct view_light_t {
+    int                     x, y, z, sight; /* what the mask was built for */
+    Uint32                  lights;         /* light_changes when built */
+    Uint8                   mask[VIEW_ROWS][SCREEN_COLS];   /* 0 = dark */
+} view_light_t;
+
+
+/*----------------------------------------------------------------------------*/
+#define INPUT_RELOAD        0x80    /* world was reloaded before this tick */
+
+typedef struct input_t {
+    Uint8                   btn, btnp;
+} input_t;
 
 
 /*
@@ -218,6 +457,10 @@ static const int            light_radius[256] = {
 };
 
 
+/*----------------------------------------------------------------------------*/
+#include "tile_flags.h"
+
+
 /*
 ================================================================================
 
@@ -234,22 +477,87 @@ static int                  btn, btnp;
 static SDL_Window           *window = NULL;
 static SDL_Renderer         *renderer = NULL;
 static SDL_Texture          *texture = NULL;
+static SDL_Texture          *frame_texture = NULL;
+static SDL_Texture          *target_texture = NULL;     /* RENDER_MODE_TILES draws here */
+static SDL_Rect             screen_rect;        /* where the screen lands in the window */
+static int                  stretch_screen = 0;
+static Uint32               tile_pixels[TILES_SIZE][TILES_SIZE];
+static Uint32               frame_pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+static int                  render_mode = RENDER_MODE_TEXTURE;
 static Uint8                screen[SCREEN_SIZE][SCREEN_SIZE];
+static Uint8                shown[SCREEN_SIZE][SCREEN_SIZE];
+static Uint32               screen_dirty[SCREEN_SIZE];  /* one bit per column */
+static int                  screen_invalid = 1;
+static screen_layer_t       screen_layers[SCREEN_LAYERS];
+static screen_layer_t       *target_layer = &screen_layers[SCREEN_LAYER_OVERLAY];
+static int                  layers_changed = 0;
+static int                  layers_animation = 0;   /* frame_animation when flattened */
+static char                 hud_text[64];
+static render_stats_t       render_stats;
+static int                  show_stats = 0;
+static int                  frame_pacing = FRAME_PACING_SLEEP;
+static pacing_stats_t       pacing_stats;
+static Uint32               frame_counter = 0;
 static int                  frame_animation = 0;
 
 
 /*----------------------------------------------------------------------------*/
-static Uint8                tilemap[2][256][256];
-static Uint8                codemap[2][256][256];
-static Uint16               objmap[2][256][256];
+static map_layer_t          *map_layers = NULL;
+static map_chunk_t          **map_slots = NULL; /* [z][cy][cx], NULL = not loaded */
+static int                  num_layers = 0;
+static int                  map_width = 0, map_height = 0;  /* in tiles */
+static int                  map_cols = 0, map_rows = 0;     /* in map chunks */
+static map_chunk_t          **map_pool = NULL;  /* every chunk ever allocated */
+static int                  map_pool_size = 0;
+static map_chunk_t          empty_chunk;        /* shared by all empty chunks */
+static obj_plane_t          no_objs;            /* shared by all chunks without objects */
+static obj_plane_t          **spare_obj_planes = NULL;
+static int                  num_spare_obj_planes = 0;
+static Uint32               map_clock = 0;
+static map_stats_t          map_stats;
 static object_t             objects[NUM_OBJECTS];
 static avatar_t             avatar;
 static Uint8                hurt_states[NUM_OBJECTS];
+static object_list_t        dead_objects;       /* objects waiting to respawn */
+static object_list_t        hurt_objects;       /* objects with hurt_states */
+static Uint16               chunk_next[NUM_OBJECTS], chunk_prev[NUM_OBJECTS];
+static Uint8                monster_field[FIELD_STRIDE * FIELD_STRIDE];     /* steps to the avatar */
+static Uint16               *object_chunk[NUM_OBJECTS];     /* head it is linked to */
+static view_light_t         view_light;         /* sight 0 = never built */
+static Uint32               light_changes = 0;  /* light sources set or removed */
+static Uint32               *signal_stack = NULL;  /* y << 16 | x */
+static Uint32               signal_depth = 0, signal_capacity = 0;
+static Uint32               signal_pulse = 0;   /* power_tile() calls so far */
+static signal_stats_t       signal_stats;
+static Uint64               free_slots[NUM_OBJECTS / 64];   /* bit set = free */
+static Uint64               free_words;         /* bit set = word has free slots */
+static Uint32               pool_exhausted = 0;
 
 
 /*----------------------------------------------------------------------------*/
-static char                 text_data[1 << 16];
+static const char           *world_file = "world.dat";
+static const char           *tiles_file = "./dev/tiles.bmp";
+static const Uint8          *world_data = NULL;     /* mapped or read world_file */
+static size_t               world_size = 0;
+static int                  world_mapped = 0;
+static int                  world_version = 0;      /* 0 = legacy layout */
+static load_stats_t         load_stats;
+static const Uint8          *map_tiles = NULL;      /* planes, layer after layer */
+static const Uint8          *map_codes = NULL;
+static Uint8                *map_buffer = NULL;     /* unpacked planes */
+static const Uint8          *map_index = NULL;      /* CHNK directory, or NULL */
+static Uint32               map_header = 0;         /* its size before the first entry */
+static const Uint8          *spawn_list = NULL;     /* SPWN section, or NULL */
+static Uint32               spawn_count = 0;
+static const char           *text_data = NULL;      /* points into world_data */
+static Uint32               text_size = 0;
+static Uint8                text_buffer[TEXT_DATA_SIZE];    /* packed text sections */
+static Uint8                info_buffer[TEXT_INFO_SIZE];
 static text_info_t          text_info[NUM_STRINGS];
+static Uint32               *text_pages = NULL;     /* offsets, grouped by key */
+static text_range_t         *text_index = NULL;     /* open addressing hash */
+static int                  text_index_bits = 0;
+static char                 check_error[80];    /* why check_world_file() failed */
 
 
 /*----------------------------------------------------------------------------*/
@@ -264,6 +572,57 @@ static int                  story_lines, story_page;
 static const char           *story_text;
 
 
+/*----------------------------------------------------------------------------*/
+static int                  healer_value, smith_item, tavern_item;
+
+
+/*----------------------------------------------------------------------------*/
+static int                  headless = 0;
+static int                  headless_runs = 1;
+static Uint16               headless_seed = 0;
+static int                  hash_interval = 0;
+static const char           *script_file = NULL;
+static const char           *replay_file = NULL;
+static const char           *record_file = NULL;
+static input_t              *inputs = NULL;     /* input per tick */
+static int                  num_inputs = 0;
+
+
+/*----------------------------------------------------------------------------*/
+static SDL_RWops            *record_rw = NULL;
+static input_t              record_input;
+static int                  record_count = 0;
+static int                  record_reload = 0;
+
+
+/*----------------------------------------------------------------------------*/
+static const char           *save_file = "quick.sav";
+static object_t             pristine_objects[NUM_OBJECTS];  /* as load_world() spawned them */
+static int                  save_failed = 0;    /* a write of the current save failed */
+
+
+/*----------------------------------------------------------------------------*/
+static int                  watch_fd = -1;      /* inotify, -1 = not watching */
+static int                  world_watch = -1, tiles_watch = -1;
+static int                  reload_flags = 0;
+static Uint32               reload_due = 0;     /* SDL_GetTicks() */
+
+
+/*----------------------------------------------------------------------------*/
+static int                  profiling = 0;
+static int                  show_profile = 0;
+static const char           *profile_file = NULL;
+static profile_frame_t      profile_frames[PROFILE_FRAMES];
+static profile_frame_t      profile_current;    /* the frame being measured */
+static Uint32               profile_count = 0;  /* frames ever recorded */
+static const char           *profile_names[PROFILE_PHASES] = {
+    "events", "tick", "draw_map", "objects", "power", "render"
+};
+static const char           *state_names[GAME_STATES] = {
+    "quit", "play", "rest", "rest2", "sail", "tavern", "healer", "smith", "story", "question"
+};
+
+
 /*
 ================================================================================
 
@@ -280,11 +639,94 @@ static void panic(const char *fmt, ...) {
     SDL_vsnprintf(message, sizeof(message), fmt, va);
     va_end(va);
 
-    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Panic!", message, window);
+    if (headless)
+        fprintf(stderr, "Panic! %s\n", message);
+    else
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Panic!", message, window);
     exit(1);
 }
 
 
+/*----------------------------------------------------------------------------*/
+static int tile_is(Uint8 id, Uint8 flags) {
+    return (tile_flags[id] & flags) != 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint64 profile_begin() {
+    return profiling ? SDL_GetPerformanceCounter() : 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static double profile_end(int phase, Uint64 start) {
+    double                  ms;
+
+    if (!profiling)
+        return 0.0;
+    ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    profile_current.ms[phase] += ms;
+    return ms;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void profile_frame() {
+    if (!profiling)
+        return;
+    /* frames without a tick are just waiting, their time is dropped */
+    if (profile_current.ticks > 0)
+        profile_frames[profile_count++ % PROFILE_FRAMES] = profile_current;
+    SDL_zero(profile_current);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int write_profile() {
+    SDL_RWops               *rw;
+    const profile_frame_t   *f;
+    Uint32                  i, first;
+    int                     j, len, ok;
+    char                    line[1024];
+
+    if ((profile_file == NULL) || (profile_count == 0))
+        return 1;
+
+    /* this also runs from atexit(), where panic() would call exit() again */
+    if ((rw = SDL_RWFromFile(profile_file, "w")) == NULL) {
+        SDL_Log("Can't write %s: %s", profile_file, SDL_GetError());
+        return 0;
+    }
+
+    len = SDL_snprintf(line, sizeof(line), "frame,ticks");
+    for (j = 0; j < PROFILE_PHASES; ++j)
+        len += SDL_snprintf(line + len, sizeof(line) - len, ",%s_ms", profile_names[j]);
+    for (j = GAME_STATE_PLAY; j < GAME_STATES; ++j)
+        len += SDL_snprintf(line + len, sizeof(line) - len, ",%s_ms", state_names[j]);
+    len += SDL_snprintf(line + len, sizeof(line) - len, "\n");
+    ok = SDL_RWwrite(rw, line, len, 1) == 1;
+
+    /* oldest frame first */
+    first = profile_count > PROFILE_FRAMES ? profile_count - PROFILE_FRAMES : 0;
+    for (i = first; ok && (i < profile_count); ++i) {
+        f = &profile_frames[i % PROFILE_FRAMES];
+        len = SDL_snprintf(line, sizeof(line), "%u,%u", i, f->ticks);
+        for (j = 0; j < PROFILE_PHASES; ++j)
+            len += SDL_snprintf(line + len, sizeof(line) - len, ",%.4f", f->ms[j]);
+        for (j = GAME_STATE_PLAY; j < GAME_STATES; ++j)
+            len += SDL_snprintf(line + len, sizeof(line) - len, ",%.4f", f->state_ms[j]);
+        len += SDL_snprintf(line + len, sizeof(line) - len, "\n");
+        ok = SDL_RWwrite(rw, line, len, 1) == 1;
+    }
+    if ((SDL_RWclose(rw) != 0) || !ok) {
+        SDL_Log("Can't write %s: %s", profile_file, SDL_GetError());
+        return 0;
+    }
+    return 1;
+}
+
+
 /*----------------------------------------------------------------------------*/
 static void clear_input() {
     btn = btnp = 0;
@@ -314,6 +756,18 @@ static Uint8 dice6() {
 }
 
 
+/*----------------------------------------------------------------------------*/
+static int lowest_bit(Uint64 value) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(value);
+#else
+    int                     bit;
+    for (bit = 0; (value & 1) == 0; value >>= 1, ++bit);
+    return bit;
+#endif
+}
+
+
 /*----------------------------------------------------------------------------*/
 static int count_lines(const char *str) {
     int                     count;
@@ -339,15 +793,25 @@ static void ask_question(int yes_state, int no_state, const char *fmt, ...) {
 }
 
 
+/*----------------------------------------------------------------------------*/
+static Uint32 hash_text_key(Uint32 key) {
+    return (key * 0x9e3779b1u) >> (32 - text_index_bits);
+}
+
+
 /*----------------------------------------------------------------------------*/
 static const char *find_text(const int x, const int y, const int z, int skip) {
-    int                     i;
-    for (i = 0; i < NUM_STRINGS; ++i) {
-        if ((text_info[i].x == x) && (text_info[i].y == y) && (text_info[i].z == z)) {
-            if (skip == 0)
-                return &text_data[text_info[i].offset];
-            else
-                --skip;
+    Uint32                  key, slot, mask;
+
+    if (text_index == NULL)
+        return NULL;
+    key = TEXT_KEY(x, y, z);
+    mask = (1u << text_index_bits) - 1;
+    for (slot = hash_text_key(key); text_index[slot].key != TEXT_NO_KEY; slot = (slot + 1) & mask) {
+        if (text_index[slot].key == key) {
+            if ((Uint32)skip >= text_index[slot].count)
+                return NULL;
+            return &text_data[text_pages[text_index[slot].first + skip]];
         }
     }
     return NULL;
@@ -357,227 +821,1022 @@ static const char *find_text(const int x, const int y, const int z, int skip) {
 /*
 ================================================================================
 
-        VIDEO FUNCTIONS
+        MAP FUNCTIONS
 
 ================================================================================
 */
 /*----------------------------------------------------------------------------*/
-static void render_screen() {
-    unsigned int            x, y, id;
-    SDL_Rect                src, dst;
+static Uint32 read_le16(const Uint8 *p) {
+    return p[0] | (p[1] << 8);
+}
 
-    if (SDL_RenderClear(renderer))
-        panic("SDL_RenderClear() failed: %s", SDL_GetError());
-    
-    src.w = src.h = dst.w = dst.h = 8;
-    for (y = 0; y < SCREEN_ROWS; ++y) {
-        dst.y = y * 8;
-        for (x = 0; x < SCREEN_COLS; ++x) {
-            dst.x = x * 8;
-            id = screen[y][x];
-            src.x = (id % 16) * 8; src.y = (id / 16) * 8;
-            if (SDL_RenderCopy(renderer, texture, &src, &dst))
-                panic("SDL_RenderCopy() failed: %s", SDL_GetError());
-        }
-    }
-    
-    SDL_RenderPresent(renderer);
+
+/*----------------------------------------------------------------------------*/
+static Uint32 read_le32(const Uint8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((Uint32)p[3] << 24);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void clear_screen() {
-    SDL_zero(screen);
+static void write_le16(Uint8 *p, Uint32 value) {
+    p[0] = (Uint8)value;
+    p[1] = (Uint8)(value >> 8);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_tile(unsigned int x, unsigned int y, unsigned int id) {
-    screen[y % SCREEN_SIZE][x % SCREEN_SIZE] = (Uint8)id;
+static int unpack_rle(const Uint8 *src, Uint32 size, Uint8 *dst, Uint32 raw_size) {
+    const Uint8             *end = src + size;
+    Uint32                  n;
+
+    /* 0x00-0x7f: n+1 literal bytes follow, 0x80-0xff: next byte repeated n-126 times */
+    while (raw_size > 0) {
+        if (src >= end)
+            return 0;
+        n = *src++;
+        if (n < 0x80) {
+            if ((++n > raw_size) || (n > (Uint32)(end - src)))
+                return 0;
+            SDL_memcpy(dst, src, n); src += n;
+        } else {
+            if (((n -= 126) > raw_size) || (src >= end))
+                return 0;
+            SDL_memset(dst, *src++, n);
+        }
+        dst += n; raw_size -= n;
+    }
+    return src == end;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_text(int x, int y, const char *text) {
-    int                     ox;
+static void release_obj_plane(map_chunk_t *chunk) {
+    /* only called when no cell refers to an object any more */
+    if (chunk->objs == no_objs)
+        return;
+    if ((spare_obj_planes = SDL_realloc(spare_obj_planes, (num_spare_obj_planes + 1) * sizeof(obj_plane_t*))) == NULL)
+        panic("SDL_realloc() failed!");
+    spare_obj_planes[num_spare_obj_planes++] = (obj_plane_t*)chunk->objs;
+    chunk->objs = no_objs;
+}
 
-    for (ox = x - 1; *text; ++text, ++x) {
-        if (*text == '\n')  { x = ox; ++y; }
-        else                draw_tile(x, y, (Uint8)*text);
+
+/*----------------------------------------------------------------------------*/
+static void claim_obj_plane(map_chunk_t *chunk) {
+    obj_plane_t             *plane;
+
+    /* chunks get object storage with their first object */
+    if (num_spare_obj_planes > 0) {
+        plane = spare_obj_planes[--num_spare_obj_planes];
+    } else {
+        if ((plane = SDL_malloc(sizeof(obj_plane_t))) == NULL)
+            panic("SDL_malloc() failed!");
+        ++map_stats.obj_planes;
     }
+    SDL_zero(*plane);
+    chunk->objs = *plane;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_textf(int x, int y, const char *fmt, ...) {
-    va_list                 va;
-    char                    text[1024];
-
-    va_start(va, fmt);
-    SDL_vsnprintf(text, sizeof(text), fmt, va);
-    va_end(va);
-    draw_text(x, y, text);
+static void free_signal_graph(signal_graph_t *graph) {
+    if (graph != NULL) {
+        SDL_free(graph->wires);
+        SDL_free(graph->net_of);
+        SDL_free(graph->cells);
+        SDL_free(graph->outs);
+        SDL_free(graph->nets);
+        SDL_free(graph);
+    }
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_box(int xl, int yl, int w, int h) {
-    int                     x, y, xh, yh;
+static void reset_map(int layers, int width, int height) {
+    int                     i, slots;
 
-    xh = xl + w + 1; yh = yl + h + 1;
-    for (y = yl + 1; y <= yh - 1; ++y)
-        for (x = xl + 1; x <= xh - 1; ++x)
-            draw_tile(x, y, 0);
-    for (x = xl + 1; x <= xh - 1; ++x) {
-        draw_tile(x, yl, TILE_UI_BORDER_H);
-        draw_tile(x, yh, TILE_UI_BORDER_H);
+    /* all chunks go back to the pool, nothing is loaded until it is needed */
+    for (i = 0; i < map_pool_size; ++i) {
+        map_pool[i]->slot = NULL;
+        release_obj_plane(map_pool[i]);
     }
-    for (y = yl + 1; y <= yh - 1; ++y) {
-        draw_tile(xl, y, TILE_UI_BORDER_V);
-        draw_tile(xh, y, TILE_UI_BORDER_V);
+    for (i = 0; i < num_layers; ++i) {
+        SDL_free(map_layers[i].heads);
+        free_signal_graph(map_layers[i].signals);
     }
-    draw_tile(xl, yl, TILE_UI_BORDER_BOX);
-    draw_tile(xh, yl, TILE_UI_BORDER_BOX);
-    draw_tile(xh, yh, TILE_UI_BORDER_BOX);
-    draw_tile(xl, yh, TILE_UI_BORDER_BOX);
+    empty_chunk.objs = no_objs;
+    slots = layers * (width >> MAP_CHUNK_SHIFT) * (height >> MAP_CHUNK_SHIFT);
+    map_layers = SDL_realloc(map_layers, layers * sizeof(map_layer_t));
+    map_slots = SDL_realloc(map_slots, slots * sizeof(map_chunk_t*));
+    if ((map_layers == NULL) || (map_slots == NULL))
+        panic("SDL_realloc() failed!");
+    SDL_memset(map_layers, 0, layers * sizeof(map_layer_t));
+    SDL_memset(map_slots, 0, slots * sizeof(map_chunk_t*));
+    num_layers = layers;
+    map_width = width; map_height = height;
+    map_cols = width >> MAP_CHUNK_SHIFT; map_rows = height >> MAP_CHUNK_SHIFT;
+    map_stats.resident = 0;
+    ++light_changes;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_map() {
-    int                     x, y, ax, ay, ox, oy, ix, iy, id, sight;
-    Uint8                   tx, ty, tz;
-    const object_t          *obj;
+static map_chunk_t *alloc_map_chunk(map_chunk_t **slot) {
+    map_chunk_t             *chunk, *oldest = NULL;
+    int                     i;
 
-    /* center view around avatar */
-    ax = avatar.obj->x;
-    ay = avatar.obj->y;
-    tz = avatar.obj->z;
-    ox = ax - (SCREEN_COLS / 2);
-    oy = ay - (SCREEN_ROWS / 2);
+    /* reuse a free chunk, or evict the least recently used clean one */
+    for (chunk = NULL, i = 0; i < map_pool_size; ++i) {
+        if (map_pool[i]->slot == NULL) {
+            chunk = map_pool[i];
+            break;
+        }
+        if (map_pool[i]->dirty || (map_pool[i]->num_objs > 0))
+            continue;
+        if ((oldest == NULL) || ((Sint32)(map_pool[i]->used - oldest->used) < 0))
+            oldest = map_pool[i];
+    }
+    if ((chunk == NULL) && (oldest != NULL) && (map_pool_size >= MAP_RESIDENT_CHUNKS)) {
+        *oldest->slot = NULL;
+        chunk = oldest;
+        ++map_stats.evictions;
+        --map_stats.resident;
+    }
+    if (chunk == NULL) {
+        if ((map_pool = SDL_realloc(map_pool, (map_pool_size + 1) * sizeof(map_chunk_t*))) == NULL)
+            panic("SDL_realloc() failed!");
+        if ((chunk = SDL_malloc(sizeof(map_chunk_t))) == NULL)
+            panic("SDL_malloc() failed!");
+        chunk->objs = no_objs;
+        map_pool[map_pool_size++] = chunk;
+    }
 
-    /* calc sight */
-    sight = tz == 0 ? light_radius[avatar.time] : 1;
-    if ((sight < TORCH_LIGHT_RADIUS) && (avatar.torch > 0))
-        sight = TORCH_LIGHT_RADIUS;
+    release_obj_plane(chunk);
+    chunk->num_objs = 0;
+    chunk->dirty = 0;
+    chunk->used = ++map_clock;
+    chunk->slot = slot;
+    *slot = chunk;
+    if (++map_stats.resident > map_stats.peak)
+        map_stats.peak = map_stats.resident;
+    return chunk;
+}
 
-    /* draw tiles */
-    for (y = 0; y < SCREEN_ROWS - 1; ++y) {
-        iy = y + oy; ty = iy;
-        if (SDL_abs(iy - ay) > sight)
-            continue;
-        for (x = 0; x < SCREEN_COLS; ++x) {
-            ix = x + ox; tx = ix;
-            if (SDL_abs(ix - ax) > sight)
-                continue;
-            if ((id = objmap[tz][ty][tx]) > 0) {
-                obj = &objects[id - 1];
-                id = hurt_states[obj->id] > 0 ? TILE_HURT : obj->picture;
-            } else {
-                id = tilemap[tz][ty][tx];
-                if ((id >= TILE_ANIMATED_FIRST) && (id <= TILE_ANIMATED_LAST))
-                    id += frame_animation;
-            }
-            draw_tile(x, y + 1, id);
+
+/*----------------------------------------------------------------------------*/
+static int read_map_chunk(int cx, int cy, int z, Uint8 *data) {
+    const Uint8             *entry;
+    Uint32                  i, offset, size;
+
+    if (map_index != NULL) {
+        /* chunked worlds are decoded one chunk at a time */
+        entry = map_index + map_header + ((z * map_rows + cy) * map_cols + cx) * 8;
+        offset = read_le32(entry);
+        size = read_le32(entry + 4);
+        if (size == 0)
+            return 0;
+        if (size == MAP_CHUNK_BYTES)
+            SDL_memcpy(data, map_index + offset, MAP_CHUNK_BYTES);
+        else if (!unpack_rle(map_index + offset, size, data, MAP_CHUNK_BYTES))
+            panic("%s: map chunk %d,%d,%d is corrupt!", world_file, cx, cy, z);
+    } else {
+        /* whole planes are copied row by row */
+        for (i = 0; i < MAP_CHUNK_SIZE; ++i) {
+            offset = (z * map_height + (cy << MAP_CHUNK_SHIFT) + i) * map_width + (cx << MAP_CHUNK_SHIFT);
+            SDL_memcpy(&data[i * MAP_CHUNK_SIZE], map_tiles + offset, MAP_CHUNK_SIZE);
+            SDL_memcpy(&data[(MAP_CHUNK_SIZE + i) * MAP_CHUNK_SIZE], map_codes + offset, MAP_CHUNK_SIZE);
         }
+        for (i = 0; (i < MAP_CHUNK_BYTES) && (data[i] == 0); ++i);
+        if (i == MAP_CHUNK_BYTES)
+            return 0;
     }
+    return 1;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_hud() {
-    draw_textf(0, 0, "%c%-3d %c%-3d %c%-3d %c %c %c   %c",
-        TILE_HEART, avatar.obj->life,
-        TILE_MONEY, avatar.money,
-        TILE_KEY, avatar.keys,
-        avatar.sword > 0 ? TILE_SWORD_0 + avatar.sword - 1 : ' ',
-        avatar.armor > 0 ? TILE_ARMOR_0 + avatar.armor - 1 : ' ',
-        avatar.torch > 0 ? TILE_TORCH : ' ',
-        TILE_CLOCK_START + avatar.time / 32
-    );
+static void load_map_chunk(map_chunk_t **slot, int cx, int cy, int z) {
+    Uint8                   data[MAP_CHUNK_BYTES];
+    map_chunk_t             *chunk;
+
+    if (!read_map_chunk(cx, cy, z, data)) {
+        *slot = &empty_chunk;
+        return;
+    }
+    chunk = alloc_map_chunk(slot);
+    SDL_memcpy(chunk->tiles, data, sizeof(chunk->tiles));
+    SDL_memcpy(chunk->codes, data + sizeof(chunk->tiles), sizeof(chunk->codes));
+    ++map_stats.loads;
 }
 
 
-/*
-================================================================================
+/*----------------------------------------------------------------------------*/
+static int wrap_x(int x) {
+    /* the map wraps around at its edges, rarely by more than its size */
+    if ((unsigned)x < (unsigned)map_width)
+        return x;
+    x += (x < 0) ? map_width : -map_width;
+    return (unsigned)x < (unsigned)map_width ? x : (x % map_width + map_width) % map_width;
+}
 
-        OBJECT FUNCTIONS
 
-================================================================================
-*/
 /*----------------------------------------------------------------------------*/
-static void remove_object(object_t *obj) {
-    if (objmap[obj->z][obj->y][obj->x] == obj->id + 1)
-        objmap[obj->z][obj->y][obj->x] = 0;
-    obj->picture = 0;
+static int wrap_y(int y) {
+    if ((unsigned)y < (unsigned)map_height)
+        return y;
+    y += (y < 0) ? map_height : -map_height;
+    return (unsigned)y < (unsigned)map_height ? y : (y % map_height + map_height) % map_height;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void move_object(object_t *obj, Uint8 x, Uint8 y, Uint8 z) {
-    if (objmap[obj->z][obj->y][obj->x] == obj->id + 1)
-        objmap[obj->z][obj->y][obj->x] = 0;
-    obj->x = x; obj->y = y; obj->z = z % 2;
-    objmap[obj->z][obj->y][obj->x] = obj->id + 1;
+static map_chunk_t **find_slot(int x, int y, Uint8 z) {
+    /* the sizes are whole chunks, so x & MAP_CHUNK_MASK is right without the wrap */
+    return &map_slots[(z * map_rows + (wrap_y(y) >> MAP_CHUNK_SHIFT)) * map_cols + (wrap_x(x) >> MAP_CHUNK_SHIFT)];
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void respawn_object(object_t *obj) {
-    if ((obj->picture == 0) || (obj->life > 0))
-        return;
-    move_object(obj, obj->spawn_x, obj->spawn_y, obj->spawn_z);
-    if ((obj->picture >= TILE_AVATAR_0) && (obj->picture <= TILE_AVATAR_1)) {
-        obj->life = 15;
-        /* preserve the keys!!! */
-        avatar.sword = avatar.sword_life = 0;
-        avatar.armor = avatar.armor_life = 0;
-        avatar.torch = avatar.money = 0;
-        avatar.obj = obj;
-    } else if ((obj->picture >= TILE_MONSTER_FIRST) && (obj->picture <= TILE_MONSTER_LAST)) {
-        obj->life = (obj->picture - TILE_MONSTER_FIRST + 1) * 2;
-    }
+static map_chunk_t *find_chunk(int x, int y, Uint8 z) {
+    map_chunk_t             **slot = find_slot(x, y, z);
+
+    if (*slot == NULL)
+        load_map_chunk(slot, wrap_x(x) >> MAP_CHUNK_SHIFT, wrap_y(y) >> MAP_CHUNK_SHIFT, z);
+    return *slot;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int spawn_object(Uint8 picture, Uint8 x, Uint8 y, Uint8 z) {
-    int                     i;
-    object_t                *obj;
-
-    for (i = 0; i < NUM_OBJECTS; ++i) {
-        obj = &objects[i];
-        if (obj->picture == 0) {
-            obj->id = (Uint16)i;
-            obj->picture = picture;
-            obj->spawn_x = x;
-            obj->spawn_y = y;
-            obj->spawn_z = z % 2;
-            respawn_object(obj);
-            return 1;
-        }
+static map_chunk_t *find_writable_chunk(int x, int y, Uint8 z) {
+    map_chunk_t             *chunk = find_chunk(x, y, z);
+
+    /* writing into an empty chunk gives it storage of its own */
+    if (chunk == &empty_chunk) {
+        chunk = alloc_map_chunk(find_slot(x, y, z));
+        SDL_zero(chunk->tiles);
+        SDL_zero(chunk->codes);
     }
-    return 0;
+    chunk->used = map_clock;
+    return chunk;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void spawn_object_nearby(Uint8 picture, Uint8 x, Uint8 y, Uint8 z) {
-    Uint8                   i, tx, ty;
-
-    z %= 2;
-    for (i = 0; i < 4; ++i) {
-        for (ty = y - i; ty <= y + i; ++ty) {
-            for (tx = x - i; tx <= x + i; ++tx) {
-                if ((tilemap[z][ty][tx] < TILE_FLOOR_FIRST) || (tilemap[z][ty][tx] > TILE_FLOOR_LAST))
-                    continue;
-                if (objmap[z][ty][tx] > 0)
-                    continue;
-                if (spawn_object(picture, tx, ty, z))
-                    return;
-            }
-        }
-    }
+static Uint8 get_tile(int x, int y, Uint8 z) {
+    return find_chunk(x, y, z)->tiles[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint8 get_code(int x, int y, Uint8 z) {
+    return find_chunk(x, y, z)->codes[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint16 get_obj(int x, int y, Uint8 z) {
+    return find_chunk(x, y, z)->objs[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void set_tile(int x, int y, Uint8 z, Uint8 tile) {
+    map_chunk_t             *chunk = find_writable_chunk(x, y, z);
+    Uint8                   *dst = &chunk->tiles[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+
+    if (tile_is(*dst, TILE_IS_LIGHT) || tile_is(tile, TILE_IS_LIGHT))
+        ++light_changes;
+    *dst = tile;
+    chunk->dirty = 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int signal_role(Uint8 code) {
+    /* 1 = carries a signal, 2 = reacts to one (gates and the home of flags or doors) */
+    if (tile_is(code, TILE_IS_WIRE))
+        return 1;
+    if (tile_is(code, TILE_IS_SPAWN) || ((code >= TILE_SIGNAL_AND) && (code <= TILE_SIGNAL_TILE)))
+        return 2;
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void set_code(int x, int y, Uint8 z, Uint8 code) {
+    map_chunk_t             *chunk = find_writable_chunk(x, y, z);
+    Uint8                   *dst = &chunk->codes[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+
+    /* the signal graph knows what the codes do, not whether wires are on */
+    if ((map_layers[z].signals != NULL) && (signal_role(*dst) != signal_role(code)))
+        map_layers[z].signals->stale = 1;
+    *dst = code;
+    chunk->dirty = 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void set_obj(int x, int y, Uint8 z, Uint16 id) {
+    map_chunk_t             *chunk = find_chunk(x, y, z);
+    Uint16                  *cell;
+
+    if (chunk->objs[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK] == id)
+        return;
+    if (chunk == &empty_chunk)
+        chunk = find_writable_chunk(x, y, z);
+    if (chunk->objs == no_objs)
+        claim_obj_plane(chunk);
+    cell = &chunk->objs[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+    /* chunks holding objects are never evicted */
+    if (*cell == 0)     ++chunk->num_objs;
+    else if (id == 0)   --chunk->num_objs;
+    *cell = id;
+    if (chunk->num_objs == 0)
+        release_obj_plane(chunk);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void clear_obj(int x, int y, Uint8 z, Uint16 id) {
+    map_chunk_t             *chunk = find_chunk(x, y, z);
+    Uint16                  *cell = &chunk->objs[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+
+    /* only if the cell still refers to this object, never the empty chunk then */
+    if (*cell == id) {
+        *cell = 0;
+        if (--chunk->num_objs == 0)
+            release_obj_plane(chunk);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void touch_map_chunks(int x, int y, Uint8 z) {
+    int                     i;
+    map_chunk_t             *chunk;
+
+    /* the view is never larger than a chunk, so its corners cover it */
+    ++map_clock;
+    for (i = 0; i < 4; ++i) {
+        chunk = *find_slot(x + ((i & 1) ? SCREEN_COLS / 2 : -SCREEN_COLS / 2),
+                           y + ((i & 2) ? SCREEN_ROWS / 2 : -SCREEN_ROWS / 2), z);
+        if (chunk != NULL)
+            chunk->used = map_clock;
+    }
+}
+
+
+/*
+================================================================================
+
+        VIDEO FUNCTIONS
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static void invalidate_screen() {
+    screen_invalid = 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void update_screen_rect() {
+    int                     w, h, scale;
+
+    if (SDL_GetRendererOutputSize(renderer, &w, &h))
+        panic("SDL_GetRendererOutputSize() failed: %s", SDL_GetError());
+
+    if (stretch_screen) {
+        screen_rect.w = w; screen_rect.h = h;
+    } else if ((w >= SCREEN_WIDTH) && (h >= SCREEN_HEIGHT)) {
+        /* whole multiples only, so every pixel stays square */
+        scale = SDL_min(w / SCREEN_WIDTH, h / SCREEN_HEIGHT);
+        screen_rect.w = SCREEN_WIDTH * scale; screen_rect.h = SCREEN_HEIGHT * scale;
+    } else if (w * SCREEN_HEIGHT > h * SCREEN_WIDTH) {
+        screen_rect.w = h * SCREEN_WIDTH / SCREEN_HEIGHT; screen_rect.h = h;
+    } else {
+        screen_rect.w = w; screen_rect.h = w * SCREEN_HEIGHT / SCREEN_WIDTH;
+    }
+    screen_rect.x = (w - screen_rect.w) / 2;
+    screen_rect.y = (h - screen_rect.h) / 2;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void render_screen_tiles() {
+    unsigned int            x, y, id;
+    SDL_Rect                src, dst;
+
+    /* the target keeps its content between frames, only dirty cells are drawn */
+    if (SDL_SetRenderTarget(renderer, target_texture))
+        panic("SDL_SetRenderTarget() failed: %s", SDL_GetError());
+    src.w = src.h = dst.w = dst.h = 8;
+    for (y = 0; y < SCREEN_ROWS; ++y) {
+        if (screen_dirty[y] == 0)
+            continue;
+        dst.y = y * 8;
+        for (x = 0; x < SCREEN_COLS; ++x) {
+            if ((screen_dirty[y] & (1u << x)) == 0)
+                continue;
+            dst.x = x * 8;
+            id = screen[y][x];
+            src.x = (id % 16) * 8; src.y = (id / 16) * 8;
+            if (SDL_RenderCopy(renderer, texture, &src, &dst))
+                panic("SDL_RenderCopy() failed: %s", SDL_GetError());
+            ++render_stats.cells;
+        }
+    }
+    if (SDL_SetRenderTarget(renderer, NULL))
+        panic("SDL_SetRenderTarget() failed: %s", SDL_GetError());
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void compose_screen(SDL_Rect *rect) {
+    unsigned int            x, y, i, id, x0, y0, x1, y1;
+    const Uint32            *src;
+    Uint32                  *dst;
+
+    /* only compose the dirty cells and track their bounding box */
+    x0 = y0 = SCREEN_SIZE; x1 = y1 = 0;
+    for (y = 0; y < SCREEN_ROWS; ++y) {
+        if (screen_dirty[y] == 0)
+            continue;
+        for (x = 0; x < SCREEN_COLS; ++x) {
+            if ((screen_dirty[y] & (1u << x)) == 0)
+                continue;
+            id = screen[y][x];
+            src = &tile_pixels[(id / 16) * 8][(id % 16) * 8];
+            dst = &frame_pixels[y * 8][x * 8];
+            for (i = 0; i < 8; ++i, src += TILES_SIZE, dst += SCREEN_WIDTH)
+                SDL_memcpy(dst, src, 8 * sizeof(Uint32));
+            if (x < x0) x0 = x;
+            if (x > x1) x1 = x;
+            ++render_stats.cells;
+        }
+        if (y < y0) y0 = y;
+        y1 = y;
+    }
+
+    rect->x = x0 * 8; rect->y = y0 * 8;
+    rect->w = (x1 - x0 + 1) * 8; rect->h = (y1 - y0 + 1) * 8;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void render_screen_texture() {
+    SDL_Rect                rect;
+
+    compose_screen(&rect);
+    if (SDL_UpdateTexture(frame_texture, &rect, &frame_pixels[rect.y][rect.x], sizeof(frame_pixels[0])))
+        panic("SDL_UpdateTexture() failed: %s", SDL_GetError());
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void flatten_layers() {
+    unsigned int            x, y, i;
+    Uint32                  bit;
+    Uint8                   id;
+    const screen_layer_t    *layers[4];
+
+    if (!layers_changed && (layers_animation == frame_animation))
+        return;
+    layers[0] = &screen_layers[SCREEN_LAYER_PROFILE];
+    layers[1] = &screen_layers[SCREEN_LAYER_OVERLAY];
+    layers[2] = &screen_layers[SCREEN_LAYER_HUD];
+    layers[3] = &screen_layers[SCREEN_LAYER_WORLD + frame_animation];
+    if (!layers[3]->valid)  /* this frame was not drawn yet, keep the last one */
+        layers[3] = &screen_layers[SCREEN_LAYER_WORLD + (frame_animation ^ 1)];
+
+    /* the topmost layer that drew a cell wins, only changed cells get dirty */
+    for (y = 0; y < SCREEN_ROWS; ++y) {
+        for (x = 0; x < SCREEN_COLS; ++x) {
+            bit = 1u << x;
+            for (id = 0, i = 0; i < 4; ++i) {
+                if (layers[i]->used[y] & bit) {
+                    id = layers[i]->cells[y][x];
+                    break;
+                }
+            }
+            screen[y][x] = id;
+            if (shown[y][x] != id)
+                screen_dirty[y] |= bit;
+            else
+                screen_dirty[y] &= ~bit;
+        }
+    }
+    layers_changed = 0;
+    layers_animation = frame_animation;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void render_screen() {
+    unsigned int            y;
+    Uint32                  dirty;
+    Uint64                  cells;
+
+    flatten_layers();
+
+    /* skip frames where nothing changed since the last present */
+    for (dirty = 0, y = 0; y < SCREEN_ROWS; ++y) {
+        if (screen_invalid) screen_dirty[y] = ~0u;
+        dirty |= screen_dirty[y];
+    }
+    if (dirty == 0) {
+        ++render_stats.skipped;
+        return;
+    }
+
+    cells = render_stats.cells;
+    if (render_mode == RENDER_MODE_TILES)
+        render_screen_tiles();
+    else
+        render_screen_texture();
+    render_stats.last_cells = (Uint32)(render_stats.cells - cells);
+    ++render_stats.frames;
+
+    /* one scaled copy of the native size screen, the bars stay black */
+    if (SDL_RenderClear(renderer))
+        panic("SDL_RenderClear() failed: %s", SDL_GetError());
+    if (SDL_RenderCopy(renderer, render_mode == RENDER_MODE_TILES ? target_texture : frame_texture, NULL, &screen_rect))
+        panic("SDL_RenderCopy() failed: %s", SDL_GetError());
+    SDL_RenderPresent(renderer);
+
+    SDL_memcpy(shown, screen, sizeof(shown));
+    SDL_zero(screen_dirty);
+    screen_invalid = 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void invalidate_layer(int layer) {
+    screen_layers[layer].valid = 0;
+    if (layer == SCREEN_LAYER_WORLD)
+        screen_layers[layer + 1].valid = 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int begin_layer(int layer) {
+    screen_layer_t          *l = &screen_layers[layer];
+
+    /* a valid layer is kept as it is, nothing needs to be drawn */
+    if (l->valid)
+        return 0;
+    SDL_zero(l->cells);
+    SDL_zero(l->used);
+    l->valid = 1;
+    target_layer = l;
+    layers_changed = 1;
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void clear_screen() {
+    SDL_zero(screen_layers);
+    target_layer = &screen_layers[SCREEN_LAYER_OVERLAY];
+    hud_text[0] = '\0';
+    layers_changed = 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_tile(unsigned int x, unsigned int y, unsigned int id) {
+    x %= SCREEN_SIZE; y %= SCREEN_SIZE;
+    target_layer->cells[y][x] = (Uint8)id;
+    target_layer->used[y] |= 1u << x;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_text(int x, int y, const char *text) {
+    int                     ox;
+
+    for (ox = x - 1; *text; ++text, ++x) {
+        if (*text == '\n')  { x = ox; ++y; }
+        else                draw_tile(x, y, (Uint8)*text);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_textf(int x, int y, const char *fmt, ...) {
+    va_list                 va;
+    char                    text[1024];
+
+    va_start(va, fmt);
+    SDL_vsnprintf(text, sizeof(text), fmt, va);
+    va_end(va);
+    draw_text(x, y, text);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_box(int xl, int yl, int w, int h) {
+    int                     x, y, xh, yh;
+
+    xh = xl + w + 1; yh = yl + h + 1;
+    for (y = yl + 1; y <= yh - 1; ++y)
+        for (x = xl + 1; x <= xh - 1; ++x)
+            draw_tile(x, y, 0);
+    for (x = xl + 1; x <= xh - 1; ++x) {
+        draw_tile(x, yl, TILE_UI_BORDER_H);
+        draw_tile(x, yh, TILE_UI_BORDER_H);
+    }
+    for (y = yl + 1; y <= yh - 1; ++y) {
+        draw_tile(xl, y, TILE_UI_BORDER_V);
+        draw_tile(xh, y, TILE_UI_BORDER_V);
+    }
+    draw_tile(xl, yl, TILE_UI_BORDER_BOX);
+    draw_tile(xh, yl, TILE_UI_BORDER_BOX);
+    draw_tile(xh, yh, TILE_UI_BORDER_BOX);
+    draw_tile(xl, yh, TILE_UI_BORDER_BOX);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void add_light(int cx, int cy, int radius) {
+    int                     x, y, light;
+
+    for (y = SDL_max(cy - radius, 0); y <= SDL_min(cy + radius, VIEW_ROWS - 1); ++y) {
+        for (x = SDL_max(cx - radius, 0); x <= SDL_min(cx + radius, SCREEN_COLS - 1); ++x) {
+            /* brightest in the middle, fading to 1 at the edge */
+            light = radius + 1 - SDL_max(SDL_abs(x - cx), SDL_abs(y - cy));
+            view_light.mask[y][x] = SDL_min(view_light.mask[y][x] + light, 255);
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int update_view_light(int ax, int ay, Uint8 tz) {
+    int                     x, y, ox, oy, tx, ty, cx = 0, sight;
+    const map_chunk_t       *chunk;
+
+    sight = tz == 0 ? light_radius[avatar.time] : 1;
+    if ((sight < TORCH_LIGHT_RADIUS) && (avatar.torch > 0))
+        sight = TORCH_LIGHT_RADIUS;
+
+    /* menus and standing still reuse the mask */
+    if ((view_light.x == ax) && (view_light.y == ay) && (view_light.z == tz) &&
+        (view_light.sight == sight) && (view_light.lights == light_changes))
+        return 0;
+    view_light.x = ax; view_light.y = ay; view_light.z = tz;
+    view_light.sight = sight;
+    view_light.lights = light_changes;
+
+    ox = ax - (SCREEN_COLS / 2);
+    oy = ay - (SCREEN_ROWS / 2);
+    SDL_memset(view_light.mask, 0, sizeof(view_light.mask));
+    add_light(ax - ox, ay - oy, sight);
+
+    /* light sources just off screen still reach into it; one chunk lookup per 32 tiles */
+    for (y = -FIRE_LIGHT_RADIUS; y < VIEW_ROWS + FIRE_LIGHT_RADIUS; ++y) {
+        ty = y + oy;
+        for (chunk = NULL, x = -FIRE_LIGHT_RADIUS; x < SCREEN_COLS + FIRE_LIGHT_RADIUS; ++x) {
+            tx = x + ox;
+            if ((chunk == NULL) || ((tx >> MAP_CHUNK_SHIFT) != cx)) {
+                cx = tx >> MAP_CHUNK_SHIFT;
+                chunk = find_chunk(tx, ty, tz);
+            }
+            if (tile_is(chunk->tiles[ty & MAP_CHUNK_MASK][tx & MAP_CHUNK_MASK], TILE_IS_LIGHT))
+                add_light(x, y, FIRE_LIGHT_RADIUS);
+        }
+    }
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_map() {
+    int                     x, y, ax, ay, ox, oy, tx, ty, cx = 0, id;
+    Uint8                   tz;
+    const object_t          *obj;
+    const map_chunk_t       *chunk;
+    Uint64                  start = profile_begin();
+
+    /* center view around avatar */
+    ax = avatar.obj->x;
+    ay = avatar.obj->y;
+    tz = avatar.obj->z;
+    ox = ax - (SCREEN_COLS / 2);
+    oy = ay - (SCREEN_ROWS / 2);
+    update_view_light(ax, ay, tz);
+
+    /* draw the lit tiles */
+    for (y = 0; y < VIEW_ROWS; ++y) {
+        ty = y + oy;
+        for (chunk = NULL, x = 0; x < SCREEN_COLS; ++x) {
+            tx = x + ox;
+            if (view_light.mask[y][x] == 0)
+                continue;
+            if ((chunk == NULL) || ((tx >> MAP_CHUNK_SHIFT) != cx)) {
+                cx = tx >> MAP_CHUNK_SHIFT;
+                chunk = find_chunk(tx, ty, tz);
+            }
+            if ((id = chunk->objs[ty & MAP_CHUNK_MASK][tx & MAP_CHUNK_MASK]) > 0) {
+                obj = &objects[id - 1];
+                id = hurt_states[obj->id] > 0 ? TILE_HURT : obj->picture;
+            } else {
+                id = chunk->tiles[ty & MAP_CHUNK_MASK][tx & MAP_CHUNK_MASK];
+                if (tile_is(id, TILE_IS_ANIMATED))
+                    id += frame_animation;
+            }
+            draw_tile(x, y + 1, id);
+        }
+    }
+    profile_end(PROFILE_DRAW_MAP, start);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_hud() {
+    char                    text[sizeof(hud_text)];
+
+    SDL_snprintf(text, sizeof(text), "%c%-3d %c%-3d %c%-3d %c %c %c   %c",
+        TILE_HEART, avatar.obj->life,
+        TILE_MONEY, avatar.money,
+        TILE_KEY, avatar.keys,
+        avatar.sword > 0 ? TILE_SWORD_0 + avatar.sword - 1 : ' ',
+        avatar.armor > 0 ? TILE_ARMOR_0 + avatar.armor - 1 : ' ',
+        avatar.torch > 0 ? TILE_TORCH : ' ',
+        TILE_CLOCK_START + avatar.time / 32
+    );
+    if (SDL_strcmp(text, hud_text) != 0) {
+        SDL_strlcpy(hud_text, text, sizeof(hud_text));
+        invalidate_layer(SCREEN_LAYER_HUD);
+    }
+    if (begin_layer(SCREEN_LAYER_HUD))
+        draw_text(0, 0, hud_text);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_background() {
+    /* the world only changes when a state or the light invalidates it */
+    if (update_view_light(avatar.obj->x, avatar.obj->y, avatar.obj->z))
+        invalidate_layer(SCREEN_LAYER_WORLD);
+    if (begin_layer(SCREEN_LAYER_WORLD + frame_animation)) {
+        draw_map();
+        ++render_stats.world_draws;
+    }
+    draw_hud();
+    invalidate_layer(SCREEN_LAYER_OVERLAY);
+    begin_layer(SCREEN_LAYER_OVERLAY);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_profile() {
+    screen_layer_t          *target = target_layer;
+    double                  sum[PROFILE_PHASES + GAME_STATES], max[PROFILE_PHASES + GAME_STATES], ms;
+    Uint32                  i, n;
+    int                     j, y, lines;
+    const profile_frame_t   *f;
+
+    /* an empty layer when hidden, the top right corner otherwise */
+    invalidate_layer(SCREEN_LAYER_PROFILE);
+    begin_layer(SCREEN_LAYER_PROFILE);
+    if (show_profile) {
+        SDL_zero(sum); SDL_zero(max);
+        n = SDL_min(profile_count, PROFILE_FRAMES);
+        for (i = 0; i < n; ++i) {
+            f = &profile_frames[i];
+            for (j = 0; j < PROFILE_PHASES + GAME_STATES; ++j) {
+                ms = j < PROFILE_PHASES ? f->ms[j] : f->state_ms[j - PROFILE_PHASES];
+                sum[j] += ms;
+                if (ms > max[j]) max[j] = ms;
+            }
+        }
+        if (n == 0) n = 1;
+
+        /* game states that did not run in these frames are left out */
+        for (lines = 1 + PROFILE_PHASES, j = 0; j < GAME_STATES; ++j)
+            if (max[PROFILE_PHASES + j] > 0.0) ++lines;
+        draw_box(SCREEN_COLS - 22, 1, 20, SDL_min(lines, SCREEN_ROWS - 4));
+        draw_text(SCREEN_COLS - 21, 2, "us/frame   avg   max");
+        for (y = 3, j = 0; (j < PROFILE_PHASES + GAME_STATES) && (y < SCREEN_ROWS - 2); ++j) {
+            if ((j >= PROFILE_PHASES) && (max[j] == 0.0))
+                continue;
+            draw_textf(SCREEN_COLS - 21, y++, "%-9s%6.0f%6.0f",
+                j < PROFILE_PHASES ? profile_names[j] : state_names[j - PROFILE_PHASES],
+                sum[j] * 1000.0 / n, max[j] * 1000.0);
+        }
+    }
+    target_layer = target;
+}
+
+
+/*
+================================================================================
+
+        OBJECT FUNCTIONS
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static int find_in_list(const object_list_t *list, Uint16 id) {
+    int                     lo, hi, mid;
+
+    for (lo = 0, hi = list->count; lo < hi;) {
+        mid = (lo + hi) / 2;
+        if (list->ids[mid] < id)    lo = mid + 1;
+        else                        hi = mid;
+    }
+    return lo;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void add_to_list(object_list_t *list, Uint16 id) {
+    int                     i;
+
+    i = find_in_list(list, id);
+    if ((i < list->count) && (list->ids[i] == id))
+        return;
+    SDL_memmove(&list->ids[i + 1], &list->ids[i], (list->count - i) * sizeof(Uint16));
+    list->ids[i] = id;
+    ++list->count;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void remove_from_list(object_list_t *list, Uint16 id) {
+    int                     i;
+
+    i = find_in_list(list, id);
+    if ((i == list->count) || (list->ids[i] != id))
+        return;
+    --list->count;
+    SDL_memmove(&list->ids[i], &list->ids[i + 1], (list->count - i) * sizeof(Uint16));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void reset_object_slots() {
+    SDL_memset(free_slots, 0xff, sizeof(free_slots));
+    free_words = ~(Uint64)0 >> (64 - NUM_OBJECTS / 64);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int alloc_object_slot() {
+    int                     word, bit;
+
+    /* always hand out the lowest free slot, like a linear scan would */
+    if (free_words == 0)
+        return -1;
+    word = lowest_bit(free_words);
+    bit = lowest_bit(free_slots[word]);
+    free_slots[word] &= ~((Uint64)1 << bit);
+    if (free_slots[word] == 0)
+        free_words &= ~((Uint64)1 << word);
+    return word * 64 + bit;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void free_object_slot(Uint16 id) {
+    free_slots[id / 64] |= (Uint64)1 << (id % 64);
+    free_words |= (Uint64)1 << (id / 64);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void reset_chunks() {
+    int                     z;
+
+    for (z = 0; z < num_layers; ++z) {
+        if (map_layers[z].heads != NULL)
+            SDL_memset(map_layers[z].heads, 0xff, (map_width >> CHUNK_SHIFT) * (map_height >> CHUNK_SHIFT) * sizeof(Uint16));
+    }
+    SDL_zero(object_chunk);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void unlink_object(Uint16 id) {
+    Uint16                  *head = object_chunk[id];
+
+    if (head == NULL)
+        return;
+    if (chunk_prev[id] != NO_OBJECT)    chunk_next[chunk_prev[id]] = chunk_next[id];
+    else                                *head = chunk_next[id];
+    if (chunk_next[id] != NO_OBJECT)    chunk_prev[chunk_next[id]] = chunk_prev[id];
+    object_chunk[id] = NULL;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void link_object(const object_t *obj) {
+    map_layer_t             *layer = &map_layers[obj->z];
+    int                     count = (map_width >> CHUNK_SHIFT) * (map_height >> CHUNK_SHIFT);
+    Uint16                  *head;
+
+    if (layer->heads == NULL) {
+        if ((layer->heads = SDL_malloc(count * sizeof(Uint16))) == NULL)
+            panic("SDL_malloc() failed!");
+        SDL_memset(layer->heads, 0xff, count * sizeof(Uint16));
+    }
+    head = &layer->heads[(obj->y >> CHUNK_SHIFT) * (map_width >> CHUNK_SHIFT) + (obj->x >> CHUNK_SHIFT)];
+
+    if (object_chunk[obj->id] == head)
+        return;
+    unlink_object(obj->id);
+    chunk_prev[obj->id] = NO_OBJECT;
+    chunk_next[obj->id] = *head;
+    if (*head != NO_OBJECT)
+        chunk_prev[*head] = obj->id;
+    *head = obj->id;
+    object_chunk[obj->id] = head;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void remove_object(object_t *obj) {
+    clear_obj(obj->x, obj->y, obj->z, obj->id + 1);
+    obj->picture = 0;
+    remove_from_list(&dead_objects, obj->id);
+    unlink_object(obj->id);
+    free_object_slot(obj->id);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void move_object(object_t *obj, int x, int y, Uint8 z) {
+    clear_obj(obj->x, obj->y, obj->z, obj->id + 1);
+    obj->x = wrap_x(x); obj->y = wrap_y(y); obj->z = z % num_layers;
+    set_obj(obj->x, obj->y, obj->z, obj->id + 1);
+    link_object(obj);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void respawn_object(object_t *obj) {
+    if ((obj->picture == 0) || (obj->life > 0)) {
+        remove_from_list(&dead_objects, obj->id);
+        return;
+    }
+    move_object(obj, obj->spawn_x, obj->spawn_y, obj->spawn_z);
+    if (tile_is(obj->picture, TILE_IS_AVATAR)) {
+        obj->life = 15;
+        /* preserve the keys!!! */
+        avatar.sword = avatar.sword_life = 0;
+        avatar.armor = avatar.armor_life = 0;
+        avatar.torch = avatar.money = 0;
+        avatar.obj = obj;
+    } else if (tile_is(obj->picture, TILE_IS_MONSTER)) {
+        obj->life = (obj->picture - TILE_MONSTER_FIRST + 1) * 2;
+    }
+    /* doors, chests etc. never get life and stay in the respawn list */
+    if (obj->life > 0)
+        remove_from_list(&dead_objects, obj->id);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int spawn_object(Uint8 picture, int x, int y, Uint8 z) {
+    int                     i;
+    object_t                *obj;
+
+    if ((i = alloc_object_slot()) < 0) {
+        if (pool_exhausted++ == 0)
+            SDL_Log("Object pool exhausted, can't spawn 0x%02x at %d,%d,%d!", picture, x, y, z);
+        return 0;
+    }
+
+    obj = &objects[i];
+    obj->id = (Uint16)i;
+    obj->picture = picture;
+    obj->spawn_x = wrap_x(x);
+    obj->spawn_y = wrap_y(y);
+    obj->spawn_z = z % num_layers;
+    add_to_list(&dead_objects, obj->id);
+    respawn_object(obj);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void spawn_object_nearby(Uint8 picture, int x, int y, Uint8 z) {
+    int                     i, tx, ty;
+
+    z %= num_layers;
+    for (i = 0; i < 4; ++i) {
+        for (ty = y - i; ty <= y + i; ++ty) {
+            for (tx = x - i; tx <= x + i; ++tx) {
+                if (!tile_is(get_tile(tx, ty, z), TILE_IS_FLOOR))
+                    continue;
+                if (get_obj(tx, ty, z) > 0)
+                    continue;
+                spawn_object(picture, tx, ty, z);
+                return;
+            }
+        }
+    }
 }
 
 
@@ -586,590 +1845,2375 @@ static void hurt_object(object_t *obj, int damage) {
     if (damage < obj->life) {
         obj->life -= damage;
         hurt_states[obj->id] = SCREEN_FPS / 3;
+        add_to_list(&hurt_objects, obj->id);
+    } else {
+        obj->life = 0;
+        set_obj(obj->x, obj->y, obj->z, 0);
+        add_to_list(&dead_objects, obj->id);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint32 signal_cell(int x, int y) {
+    return ((Uint32)wrap_y(y) << 16) | wrap_x(x);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void *grow_signal_array(void *array, Uint32 count, Uint32 *capacity, size_t size) {
+    if (count < *capacity)
+        return array;
+    *capacity = *capacity ? *capacity * 2 : 1024;
+    if ((array = SDL_realloc(array, *capacity * size)) == NULL)
+        panic("SDL_realloc() failed!");
+    return array;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int compare_cells(const void *a, const void *b) {
+    const Uint32            x = *(const Uint32*)a, y = *(const Uint32*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int find_wire(const signal_graph_t *graph, Uint32 cell) {
+    int                     lo = 0, hi = (int)graph->num_wires - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) >> 1;
+        if (graph->wires[mid] < cell)       lo = mid + 1;
+        else if (graph->wires[mid] > cell)  hi = mid - 1;
+        else                                return mid;
+    }
+    return -1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint32 find_wire_root(Uint32 *parent, Uint32 i) {
+    while (parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void join_wires(Uint32 *parent, Uint32 a, int b) {
+    Uint32                  ra, rb;
+
+    if (b < 0)
+        return;
+    ra = find_wire_root(parent, a);
+    rb = find_wire_root(parent, (Uint32)b);
+    /* the lower index is the root, so nets are numbered in scan order */
+    if (ra < rb)        parent[rb] = ra;
+    else if (rb < ra)   parent[ra] = rb;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void find_net_outs(signal_graph_t *graph, signal_net_t *net, Uint8 z, Uint32 *capacity) {
+    static const int        dx[4] = { 0, 1, 0, -1 }, dy[4] = { -1, 0, 1, 0 };
+    Uint32                  i, n, cell, *outs;
+    int                     x, y, d;
+
+    /* the cells around the net that may react to it, each of them once */
+    net->first_out = graph->num_outs;
+    for (i = 0; i < net->num_cells; ++i) {
+        x = graph->cells[net->first_cell + i] & 0xffff;
+        y = graph->cells[net->first_cell + i] >> 16;
+        for (d = 0; d < 4; ++d) {
+            cell = signal_cell(x + dx[d], y + dy[d]);
+            if ((signal_role(get_code(x + dx[d], y + dy[d], z)) != 2) && (get_obj(x + dx[d], y + dy[d], z) == 0))
+                continue;
+            graph->outs = grow_signal_array(graph->outs, graph->num_outs, capacity, sizeof(Uint32));
+            graph->outs[graph->num_outs++] = cell;
+        }
+    }
+    outs = &graph->outs[net->first_out];
+    SDL_qsort(outs, graph->num_outs - net->first_out, sizeof(Uint32), compare_cells);
+    for (n = i = 0; i < graph->num_outs - net->first_out; ++i)
+        if ((n == 0) || (outs[i] != outs[n - 1]))
+            outs[n++] = outs[i];
+    net->num_outs = n;
+    graph->num_outs = net->first_out + n;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static signal_graph_t *compile_signal_graph(Uint8 z) {
+    signal_graph_t          *graph;
+    const map_chunk_t       *chunk = NULL;
+    Uint32                  i, n, root, *parent, capacity = 0;
+    int                     x, y, cx;
+
+    if ((graph = SDL_calloc(1, sizeof(signal_graph_t))) == NULL)
+        panic("SDL_calloc() failed!");
+
+    /* every wire of the layer, sorted as they are found row by row */
+    for (y = 0; y < map_height; ++y) {
+        for (cx = -1, x = 0; x < map_width; ++x) {
+            if ((x >> MAP_CHUNK_SHIFT) != cx) {
+                cx = x >> MAP_CHUNK_SHIFT;
+                if ((chunk = find_chunk(x, y, z)) == &empty_chunk) {
+                    x |= MAP_CHUNK_MASK;
+                    continue;
+                }
+            }
+            if (tile_is(chunk->codes[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK], TILE_IS_WIRE)) {
+                graph->wires = grow_signal_array(graph->wires, graph->num_wires, &capacity, sizeof(Uint32));
+                graph->wires[graph->num_wires++] = ((Uint32)y << 16) | x;
+            }
+        }
+    }
+    n = graph->num_wires;
+    graph->net_of = SDL_malloc((n + 1) * sizeof(Uint32));
+    graph->cells = SDL_malloc((n + 1) * sizeof(Uint32));
+    parent = SDL_malloc((n + 1) * sizeof(Uint32));
+    if ((graph->net_of == NULL) || (graph->cells == NULL) || (parent == NULL))
+        panic("SDL_malloc() failed!");
+
+    /* wires touching to the right or below are one net, across the edges too */
+    for (i = 0; i < n; ++i)
+        parent[i] = i;
+    for (i = 0; i < n; ++i) {
+        x = graph->wires[i] & 0xffff; y = graph->wires[i] >> 16;
+        join_wires(parent, i, find_wire(graph, signal_cell(x + 1, y)));
+        join_wires(parent, i, find_wire(graph, signal_cell(x, y + 1)));
+    }
+    for (i = 0; i < n; ++i) {
+        if ((root = find_wire_root(parent, i)) == i)
+            graph->net_of[i] = graph->num_nets++;
+        else
+            graph->net_of[i] = graph->net_of[root];
+    }
+
+    /* group the wires by net, then find what each net drives */
+    if ((graph->nets = SDL_calloc(graph->num_nets + 1, sizeof(signal_net_t))) == NULL)
+        panic("SDL_calloc() failed!");
+    for (i = 0; i < n; ++i)
+        ++graph->nets[graph->net_of[i]].num_cells;
+    for (i = 1; i < graph->num_nets; ++i)
+        graph->nets[i].first_cell = graph->nets[i - 1].first_cell + graph->nets[i - 1].num_cells;
+    for (i = 0; i < graph->num_nets; ++i)
+        parent[i] = graph->nets[i].first_cell;
+    for (i = 0; i < n; ++i)
+        graph->cells[parent[graph->net_of[i]]++] = graph->wires[i];
+    SDL_free(parent);
+    for (capacity = 0, i = 0; i < graph->num_nets; ++i)
+        find_net_outs(graph, &graph->nets[i], z, &capacity);
+    return graph;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static signal_graph_t *find_signal_graph(Uint8 z) {
+    map_layer_t             *layer = &map_layers[z];
+
+    /* compiled when first needed, again after wires were added or removed */
+    if ((layer->signals != NULL) && layer->signals->stale) {
+        free_signal_graph(layer->signals);
+        layer->signals = NULL;
+    }
+    if (layer->signals == NULL)
+        layer->signals = compile_signal_graph(z);
+    return layer->signals;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void push_power_tile(Uint32 cell) {
+    signal_stack = grow_signal_array(signal_stack, signal_depth, &signal_capacity, sizeof(Uint32));
+    signal_stack[signal_depth++] = cell;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void power_net(const signal_graph_t *graph, signal_net_t *net, Uint8 z) {
+    map_chunk_t             *chunk = NULL;
+    Uint8                   *code;
+    Uint32                  i, cell, key = 0;
+    int                     x, y;
+
+    /* once per pulse, wires looping back through a gate end there */
+    if (net->pulse == signal_pulse)
+        return;
+    net->pulse = signal_pulse;
+    signal_stats.last_visited += net->num_cells;
+
+    /* a net that is on already is evaluated again, only its gates see it */
+    for (i = 0; i < net->num_cells; ++i) {
+        cell = graph->cells[net->first_cell + i];
+        x = cell & 0xffff; y = cell >> 16;
+        if ((chunk == NULL) || ((cell & ~(Uint32)0x1f001f) != key)) {
+            key = cell & ~(Uint32)0x1f001f;
+            chunk = find_chunk(x, y, z);
+        }
+        /* a stale graph may still list wires a tile swap took away */
+        code = &chunk->codes[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+        if (*code == TILE_SIGNAL_OFF) {
+            *code = TILE_SIGNAL_ON;
+            chunk->dirty = 1;
+        }
+    }
+
+    /* pushed in reverse, so they are visited in the order of the map */
+    for (i = net->num_outs; i-- > 0; )
+        push_power_tile(graph->outs[net->first_out + i]);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void visit_power_tile(signal_graph_t *graph, int x, int y, Uint8 z) {
+    object_t                *obj;
+    map_chunk_t             *chunk = find_chunk(x, y, z);
+    int                     id;
+
+    ++signal_stats.last_visited;
+    switch (chunk->codes[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK]) {
+        case TILE_SIGNAL_OFF:
+        case TILE_SIGNAL_ON:
+            /* wires a tile swap added in this pulse wait for the next one */
+            if ((id = find_wire(graph, signal_cell(x, y))) >= 0)
+                power_net(graph, &graph->nets[graph->net_of[id]], z);
+            return;
+        case TILE_SIGNAL_AND:
+            if ((get_code(x, y - 1, z) == TILE_SIGNAL_ON) && (get_code(x, y + 1, z) == TILE_SIGNAL_ON))
+                push_power_tile(signal_cell(x + 1, y));
+            return;
+        case TILE_SIGNAL_OR:
+            if ((get_code(x, y - 1, z) == TILE_SIGNAL_ON) || (get_code(x, y + 1, z) == TILE_SIGNAL_ON))
+                push_power_tile(signal_cell(x + 1, y));
+            return;
+        case TILE_SIGNAL_TILE:
+            id = get_code(x + 1, y, z);
+            set_code(x + 1, y, z, get_tile(x + 1, y, z));
+            set_tile(x + 1, y, z, id);
+            return;
+    }
+
+    if ((id = chunk->objs[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK]) > 0) {
+        obj = &objects[id - 1];
+        if (obj->picture == TILE_FLAG_OFF) {
+            obj->picture = TILE_FLAG_ON;
+        } else if (obj->picture == TILE_DOOR_MAGIC) {
+            obj->picture = TILE_DOOR_CLOSED;
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void power_tile(int x, int y, Uint8 z) {
+    signal_graph_t          *graph;
+    Uint32                  cell;
+    Uint64                  start = profile_begin();
+
+    ++signal_stats.activations;
+    signal_stats.last_visited = 0;
+
+    /* whole nets are switched at once, the stack only holds what they drive */
+    graph = find_signal_graph(z);
+    ++signal_pulse;
+    signal_depth = 0;
+    push_power_tile(signal_cell(x - 1, y));
+    push_power_tile(signal_cell(x, y + 1));
+    push_power_tile(signal_cell(x + 1, y));
+    push_power_tile(signal_cell(x, y - 1));
+    while (signal_depth > 0) {
+        cell = signal_stack[--signal_depth];
+        visit_power_tile(graph, cell & 0xffff, cell >> 16, z);
+    }
+
+    if (signal_stats.last_visited > signal_stats.max_visited)
+        signal_stats.max_visited = signal_stats.last_visited;
+    signal_stats.total_visited += signal_stats.last_visited;
+    profile_end(PROFILE_POWER, start);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int_fast8_t move_monster(object_t *obj, int dx, int dy) {
+    int                     new_x, new_y, id, damage;
+    object_t                *dst;
+
+    new_x = wrap_x(obj->x + dx);
+    new_y = wrap_y(obj->y + dy);
+
+    if ((id = get_obj(new_x, new_y, obj->z)) > 0) {
+        dst = &objects[id - 1];
+        if (tile_is(dst->picture, TILE_IS_AVATAR)) {
+            damage = (obj->picture - TILE_MONSTER_FIRST) * 2 + 1;
+            if (avatar.armor > 0) {
+                if ((damage -= avatar.armor * 2) < 1)
+                    damage = 1;
+                if (--avatar.armor_life == 0)
+                    avatar.armor = 0;
+            }
+            hurt_object(dst, damage);
+        }
+        return 0;
+    }
+    if (!tile_is(get_tile(new_x, new_y, obj->z), TILE_IS_FLOOR))
+        return 0;
+    
+    move_object(obj, new_x, new_y, obj->z);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const int            field_steps[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+static const int            field_offsets[4] = { 1, -1, FIELD_STRIDE, -FIELD_STRIDE };
+
+
+/*----------------------------------------------------------------------------*/
+static void build_monster_field() {
+    static Uint16           queue[FIELD_SIZE * FIELD_SIZE];
+    int                     head, tail, i, x, y, ox, oy, tx, ty, cx, id, cell, next;
+    Uint8                   z = avatar.obj->z, *row;
+    const map_chunk_t       *chunk = NULL;
+
+    /* free floor is open, monsters do not block; one chunk lookup per row */
+    ox = avatar.obj->x - ACTIVATION_RADIUS;
+    oy = avatar.obj->y - ACTIVATION_RADIUS;
+    SDL_memset(monster_field, FIELD_WALL, sizeof(monster_field));
+    for (y = 0; y < FIELD_SIZE; ++y) {
+        ty = oy + y;
+        row = &monster_field[(y + 1) * FIELD_STRIDE + 1];
+        for (cx = -1, x = 0; x < FIELD_SIZE; ++x) {
+            tx = ox + x;
+            /* like gather_monsters(), the field does not wrap around the map */
+            if ((tx < 0) || (tx >= map_width) || (ty < 0) || (ty >= map_height))
+                continue;
+            if ((tx >> MAP_CHUNK_SHIFT) != cx) {
+                cx = tx >> MAP_CHUNK_SHIFT;
+                chunk = find_chunk(tx, ty, z);
+            }
+            id = chunk->objs[ty & MAP_CHUNK_MASK][tx & MAP_CHUNK_MASK];
+            if (tile_is(chunk->tiles[ty & MAP_CHUNK_MASK][tx & MAP_CHUNK_MASK], TILE_IS_FLOOR) &&
+                ((id == 0) || tile_is(objects[id - 1].picture, TILE_IS_MONSTER)))
+                row[x] = FIELD_FAR;
+        }
+    }
+
+    /* breadth first from the avatar, the border stops it */
+    cell = (ACTIVATION_RADIUS + 1) * FIELD_STRIDE + ACTIVATION_RADIUS + 1;
+    monster_field[cell] = 0;
+    queue[0] = (Uint16)cell;
+    for (head = 0, tail = 1; head < tail; ++head) {
+        cell = queue[head];
+        for (i = 0; i < 4; ++i) {
+            next = cell + field_offsets[i];
+            if (monster_field[next] != FIELD_FAR)
+                continue;
+            monster_field[next] = monster_field[cell] + 1;
+            queue[tail++] = (Uint16)next;
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void step_monster(object_t *obj) {
+    int                     i, cell, d, best, count, choices[4];
+
+    /* step downhill, a random one of the best ways when there are several */
+    cell = (obj->y - avatar.obj->y + ACTIVATION_RADIUS + 1) * FIELD_STRIDE + obj->x - avatar.obj->x + ACTIVATION_RADIUS + 1;
+    for (best = monster_field[cell], count = 0, i = 0; i < 4; ++i) {
+        if ((d = monster_field[cell + field_offsets[i]]) < best) {
+            best = d;
+            count = 0;
+        }
+        if ((d == best) && (d < monster_field[cell]))
+            choices[count++] = i;
+    }
+    i = rand16();
+    if (count > 0) {
+        i = choices[i % count];
+        move_monster(obj, field_steps[i][0], field_steps[i][1]);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_object_turn(object_t *obj) {
+    if (tile_is(obj->picture, TILE_IS_MONSTER)) {
+        int                 ax, ay;
+
+        if ((obj->life == 0) || (obj->z != avatar.obj->z))
+            return;
+
+        ax = avatar.obj->x; ay = avatar.obj->y;
+        if ((SDL_abs(obj->x - ax) > ACTIVATION_RADIUS) || (SDL_abs(obj->y - ay) > ACTIVATION_RADIUS))
+            return;
+
+        step_monster(obj);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int compare_ids(const void *a, const void *b) {
+    return *(const Uint16*)a - *(const Uint16*)b;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int gather_monsters(Uint16 *ids) {
+    int                     count, ax, ay, cx, cy, cx0, cy0, cx1, cy1;
+    Uint16                  id;
+    const Uint16            *heads = map_layers[avatar.obj->z].heads;
+    const object_t          *obj;
+
+    /* the monsters in the chunks around the avatar that are close enough */
+    if (heads == NULL)
+        return 0;
+    ax = avatar.obj->x; ay = avatar.obj->y;
+    cx0 = SDL_max(ax - ACTIVATION_RADIUS, 0) >> CHUNK_SHIFT;
+    cy0 = SDL_max(ay - ACTIVATION_RADIUS, 0) >> CHUNK_SHIFT;
+    cx1 = SDL_min(ax + ACTIVATION_RADIUS, map_width - 1) >> CHUNK_SHIFT;
+    cy1 = SDL_min(ay + ACTIVATION_RADIUS, map_height - 1) >> CHUNK_SHIFT;
+    for (count = 0, cy = cy0; cy <= cy1; ++cy) {
+        for (cx = cx0; cx <= cx1; ++cx) {
+            for (id = heads[cy * (map_width >> CHUNK_SHIFT) + cx]; id != NO_OBJECT; id = chunk_next[id]) {
+                obj = &objects[id];
+                if (!tile_is(obj->picture, TILE_IS_MONSTER) || (obj->life == 0))
+                    continue;
+                if ((SDL_abs(obj->x - ax) > ACTIVATION_RADIUS) || (SDL_abs(obj->y - ay) > ACTIVATION_RADIUS))
+                    continue;
+                ids[count++] = id;
+            }
+        }
+    }
+    return count;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void handle_all_objects() {
+    static Uint16           ids[NUM_OBJECTS];
+    int                     i, count;
+    Uint64                  start = profile_begin();
+
+    /* monsters act in id order, so the random numbers match a full scan */
+    if ((count = gather_monsters(ids)) > 0)
+        build_monster_field();
+    SDL_qsort(ids, count, sizeof(ids[0]), compare_ids);
+    for (i = 0; i < count; ++i)
+        on_object_turn(&objects[ids[i]]);
+    profile_end(PROFILE_OBJECTS, start);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void move_avatar(int dx, int dy) {
+    object_t                *obj, *dst;
+    int                     new_x, new_y, id, sight;
+    Uint8                   new_z;
+
+    obj = avatar.obj;
+    new_x = wrap_x(obj->x + dx);
+    new_y = wrap_y(obj->y + dy);
+    new_z = obj->z;
+
+    if ((id = get_obj(new_x, new_y, new_z)) > 0) {
+        dst = &objects[id - 1];
+        if (tile_is(dst->picture, TILE_IS_MONSTER)) {
+            hurt_object(dst, avatar.sword * 2 + 1);
+            if (avatar.sword_life > 0) {
+                if (--avatar.sword_life == 0)
+                    avatar.sword = 0;
+            }
+            if (dst->life == 0)
+                spawn_object_nearby(TILE_MONEY, dst->x, dst->y, dst->z);
+        } else if ((dst->picture == TILE_MONEY) && (avatar.money < 255)) {
+            int     money = avatar.money + dice6() + dice6();
+            if (money > 255) money = 255;
+            avatar.money = money;
+            remove_object(dst);
+        } else if ((dst->picture == TILE_KEY) && (avatar.keys < 8)) {
+            ++avatar.keys;
+            remove_object(dst);
+        } else if (dst->picture == TILE_FLAG_OFF) {
+            power_tile(dst->x, dst->y, dst->z);
+        } else if (dst->picture == TILE_CHEST_OPEN) {
+            dst->picture = TILE_CHEST_CLOSED;
+            spawn_object_nearby(TILE_MONEY, dst->x, dst->y, dst->z);
+        } else if (dst->picture == TILE_DOOR_CLOSED) {
+            set_obj(dst->x, dst->y, dst->z, 0);
+            set_tile(dst->x, dst->y, dst->z, TILE_DOOR_OPEN);
+        } else if ((dst->picture == TILE_DOOR_LOCKED) && (avatar.keys > 0)) {
+            obj->picture = TILE_DOOR_CLOSED;
+            --avatar.keys;
+        }
+        return;
+    }
+    id = get_tile(new_x, new_y, new_z);
+    if (!tile_is(id, TILE_IS_FLOOR)) {
+        /* walls and water just block */
+        if (!tile_is(id, TILE_IS_INTERACTIVE))
+            return;
+        switch (id) {
+            case TILE_DOCK:
+                avatar.sail_x = dx;
+                avatar.sail_y = dy;
+                ask_question(GAME_STATE_SAIL, GAME_STATE_PLAY, "Do you want to sail?");
+                break;
+            case TILE_FIRE_PLACE:
+                ask_question(GAME_STATE_REST, GAME_STATE_PLAY, "A cosy fireplace.\nDo you want to rest?");
+                return;
+            case TILE_SIGN_POST:
+            case TILE_STORY_0:
+            case TILE_STORY_1:
+            case TILE_STORY_2:
+            case TILE_STORY_3:
+                story_x = new_x; story_y = new_y; story_z = new_z;
+                story_text = NULL; story_page = 0;
+                enter_state(GAME_STATE_STORY);
+                return;
+            case TILE_HEALER_0:
+            case TILE_HEALER_1:
+                enter_state(GAME_STATE_HEALER);
+                return;
+            case TILE_SMITH_0:
+            case TILE_SMITH_1:
+                enter_state(GAME_STATE_SMITH);
+                return;
+            case TILE_TAVERN_0:
+            case TILE_TAVERN_1:
+                enter_state(GAME_STATE_TAVERN);
+                return;
+            default:
+                return;
+        }
+    }
+
+    move_object(obj, new_x, new_y, new_z);
+
+    /* adjust torch life */
+    sight = obj->z == 0 ? light_radius[avatar.time] : 1;
+    if ((sight < TORCH_LIGHT_RADIUS) && (avatar.torch > 0))
+        --avatar.torch;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int on_avatar_turn() {
+    if (btn & BUTTON_UP) {
+        move_avatar(0, -1);
+        return 1;
+    } else if (btn & BUTTON_DOWN) {
+        move_avatar(0, 1);
+        return 1;
+    } else if (btn & BUTTON_LEFT) {
+        move_avatar(-1, 0);
+        return 1;
+    } else if (btn & BUTTON_RIGHT) {
+        move_avatar(1, 0);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+================================================================================
+
+        GAME STATE FUNCTIONS
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static void on_nightfall() {
+    Uint16                  ids[NUM_OBJECTS];
+    int                     i, count;
+
+    /* respawning removes objects from the list, so walk a copy */
+    count = dead_objects.count;
+    SDL_memcpy(ids, dead_objects.ids, count * sizeof(Uint16));
+    for (i = 0; i < count; ++i)
+        respawn_object(&objects[ids[i]]);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void advance_time(int turns) {
+    for (; turns > 0; --turns) {
+        ++avatar.time;
+        if (avatar.time == 0) {             /* jump out of resting... */
+            enter_state(GAME_STATE_PLAY);
+            return;
+        } else if (avatar.time == 192) {    /* midnight */
+            on_nightfall();
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_game_state_play() {
+    int                     i;
+
+    /* advance hurt states */
+    for (i = hurt_objects.count - 1; i >= 0; --i)
+        if (--hurt_states[hurt_objects.ids[i]] == 0)
+            remove_from_list(&hurt_objects, hurt_objects.ids[i]);
+
+    if (on_avatar_turn()) {
+        handle_all_objects();
+        advance_time(1);
+    }
+
+    invalidate_layer(SCREEN_LAYER_WORLD);
+    draw_background();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void rest_turn(const int heal) {
+    if ((heal) && (avatar.obj->life < 15))
+        ++avatar.obj->life;
+    handle_all_objects();
+    advance_time(8);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void rest_until_dawn(const int heal) {
+    static Uint16           ids[NUM_OBJECTS];
+    int                     state = game_state, quiet, next;
+
+    while (game_state == state) {
+        /* with a monster in range every turn has to be played */
+        if (gather_monsters(ids) == 0) {
+            /*
+                Nothing moves until midnight respawns the dead or dawn ends
+                the rest, so the turns that stay before either only add up.
+            */
+            next = avatar.time < 192 ? 192 : 256;
+            quiet = (next - avatar.time - 1) / 8;
+            if ((heal) && (avatar.obj->life < 15))
+                avatar.obj->life = SDL_min(avatar.obj->life + quiet, 15);
+            avatar.time += quiet * 8;
+        }
+        rest_turn(heal);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_game_state_rest(const int heal) {
+    if (btnp & BUTTON_B) {
+        enter_state(GAME_STATE_PLAY);
+        return;
+    }
+    if (btnp & BUTTON_A)
+        rest_until_dawn(heal);
+    else
+        rest_turn(heal);
+
+    invalidate_layer(SCREEN_LAYER_WORLD);
+    draw_background();
+
+    draw_box(2, 2, SCREEN_COLS - 6, 1);
+    draw_textf(3, 3, "Resting %c=Skip %c=Cancel", TILE_BUTTON_A, TILE_BUTTON_B);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_game_state_sail() {
+    Uint8                   tmp;
+    object_t                *obj = avatar.obj;
+
+    move_object(obj, obj->x + avatar.sail_x, obj->y + avatar.sail_y, obj->z);
+    advance_time(1);
+
+    if (get_tile(obj->x, obj->y, obj->z) == TILE_DOCK)
+        enter_state(GAME_STATE_PLAY);
+
+    /* monkey patch the picture for drawing */
+    tmp = obj->picture; obj->picture = TILE_SHIP;
+
+    invalidate_layer(SCREEN_LAYER_WORLD);
+    draw_background();
+
+    obj->picture = tmp;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_game_state_healer() {
+    if (btnp & BUTTON_A) {
+        avatar.money -= healer_value * 3;
+        avatar.obj->life += healer_value * 2;
+        enter_state(GAME_STATE_PLAY);
+    } else if (btnp & BUTTON_B) {
+        enter_state(GAME_STATE_PLAY);
+    } else if (btn & (BUTTON_UP | BUTTON_LEFT)) {
+        if (healer_value > 0) --healer_value;
+    } else if (btn & (BUTTON_DOWN | BUTTON_RIGHT)) {
+        ++healer_value;
+    }
+
+    while ((avatar.obj->life + healer_value * 2) > 255) --healer_value;
+    while ((healer_value * 3) > avatar.money)           --healer_value;
+
+    draw_background();
+
+    draw_box(2, 2, SCREEN_COLS - 6, 5);
+    draw_textf(3, 3,
+        "Do you need some healing?\n\n"
+        "%c %c%-3d for %c%-3d\n"
+        "\n"
+        "%c=Accept  %c=Deny",
+        TILE_UI_ARROW_0 + frame_animation,
+        TILE_HEART, healer_value * 2,
+        TILE_MONEY, healer_value * 3,
+        TILE_BUTTON_A, TILE_BUTTON_B
+    );
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_game_state_smith() {
+    int                     i, cost;
+
+    if (btnp & BUTTON_A) {
+        cost = ((smith_item % 4) + 1) * 50;
+        if (avatar.money >= cost) {
+            if (smith_item < 4) {
+                i = smith_item + 1;
+                if (avatar.sword < i) {
+                    avatar.money -= cost;
+                    avatar.sword = i;
+                    avatar.sword_life = 64;
+                }
+            } else {
+                i = smith_item - 4 + 1;
+                if (avatar.armor < i) {
+                    avatar.money -= cost;
+                    avatar.armor = i;
+                    avatar.armor_life = 64;
+                }
+            }
+        }
+    } else if (btnp & BUTTON_B) {
+        enter_state(GAME_STATE_PLAY);
+    } else if (btn & (BUTTON_UP | BUTTON_LEFT)) {
+        if (smith_item > 0) --smith_item;
+    } else if (btn & (BUTTON_DOWN | BUTTON_RIGHT)) {
+        if (smith_item < 7) ++smith_item;
+    }
+
+    draw_background();
+
+    draw_box(2, 2, SCREEN_COLS - 6, 12);
+    draw_text(3, 3, "Finest weapons and armor!");
+    for (i = 0; i < 4; ++i)
+        draw_textf(5, 5 + i, "%c +%d damage for %c%-3d", TILE_SWORD_0 + i, (i + 1) * 2, TILE_MONEY, (i + 1) * 50);
+    for (i = 0; i < 4; ++i)
+        draw_textf(5, 9 + i, "%c +%d armor  for %c%-3d", TILE_ARMOR_0 + i, (i + 1) * 2, TILE_MONEY, (i + 1) * 50);
+    draw_tile(3, 5 + smith_item, TILE_UI_ARROW_0 + frame_animation);
+    draw_textf(3, 14, "   %c=Buy   %c=Goodbye...", TILE_BUTTON_A, TILE_BUTTON_B);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_game_state_tavern() {
+    if (btnp & BUTTON_A) {
+        switch (tavern_item) {
+            case 0: /* rest */
+                avatar.obj->spawn_x = avatar.obj->x;
+                avatar.obj->spawn_y = avatar.obj->y;
+                avatar.obj->spawn_z = avatar.obj->z;
+                enter_state(GAME_STATE_REST2);
+                break;
+            case 1: /* torch */
+                if ((avatar.money >= 15) && (avatar.torch < 255)) {
+                    avatar.money -= 15;
+                    avatar.torch = 255;
+                }
+                break;
+            case 2: /* potion */
+            case 3:
+                if ((avatar.money >= 250) && (avatar.potions[tavern_item - 2] == 0)) {
+                    avatar.money -= 250;
+                    avatar.potions[tavern_item - 2] = 2;
+                }
+                break;
+        }
+    } else if (btnp & BUTTON_B) {
+        enter_state(GAME_STATE_PLAY);
+    } else if (btn & (BUTTON_UP | BUTTON_LEFT)) {
+        if (tavern_item > 0) --tavern_item;
+    } else if (btn & (BUTTON_DOWN | BUTTON_RIGHT)) {
+        if (tavern_item < 3) ++tavern_item;
+    }
+
+    draw_background();
+
+    draw_box(2, 2, SCREEN_COLS - 6, 8);
+    draw_textf(3, 3,
+        "Welcome to the tavern!\n"
+        "\n"
+        "  Rest here.\n"
+        "  %c for %c%-3d\n"
+        "  %c for %c%-3d\n"
+        "  %c for %c%-3d\n"
+        "\n"
+        "   %c=Buy   %c=Goodbye...",
+        TILE_TORCH, TILE_MONEY, 15,
+        TILE_POTION_A, TILE_MONEY, 250,
+        TILE_POTION_B, TILE_MONEY, 250,
+        TILE_BUTTON_A, TILE_BUTTON_B
+    );
+    draw_tile(3, 5 + tavern_item, TILE_UI_ARROW_0 + frame_animation);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_game_state_story() {
+    if (btnp & BUTTON_A) {
+        ++story_page; story_text = NULL;
+    } else if (btnp & BUTTON_B) {
+        enter_state(GAME_STATE_PLAY);
+    }
+
+    /* advance to next page if possible */
+    if (story_text == NULL) {
+        story_text = find_text(story_x, story_y, story_z, story_page);
+        if (story_text == NULL) {
+            enter_state(GAME_STATE_PLAY);
+            return;
+        }
+        story_lines = count_lines(story_text);
+    }
+    
+    draw_background();
+
+    draw_box(0, 2, SCREEN_COLS - 2, story_lines + 2);
+    draw_text(1, 3, story_text);
+    draw_textf(SCREEN_COLS / 2 - 9, 3 + story_lines + 1, "%c=Continue   %c=Bye", TILE_BUTTON_A, TILE_BUTTON_B);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_game_state_question() {
+    if (btnp & BUTTON_A)
+        enter_state(question_states[0]);
+    else if (btnp & BUTTON_B)
+        enter_state(question_states[1]);
+    
+    draw_background();
+
+    draw_box(2, 2, SCREEN_COLS - 6, question_lines + 2);
+    draw_text(3, 3, question_text);
+    draw_textf(3, 3 + question_lines + 1, "%c=Yes %c=No", TILE_BUTTON_A, TILE_BUTTON_B);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void on_tick() {
+    switch (game_state) {
+        case GAME_STATE_PLAY:       on_game_state_play(); break;
+        case GAME_STATE_REST:       on_game_state_rest(0); break;
+        case GAME_STATE_REST2:      on_game_state_rest(1); break;
+        case GAME_STATE_SAIL:       on_game_state_sail(); break;
+        case GAME_STATE_HEALER:     on_game_state_healer(); break;
+        case GAME_STATE_SMITH:      on_game_state_smith(); break;
+        case GAME_STATE_TAVERN:     on_game_state_tavern(); break;
+        case GAME_STATE_STORY:      on_game_state_story(); break;
+        case GAME_STATE_QUESTION:   on_game_state_question(); break;
+    }
+}
+
+
+/*
+================================================================================
+
+        I/O FUNCTIONS
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static int compare_text_pages(const void *a, const void *b) {
+    const text_info_t       *x = &text_info[*(const Uint32*)a], *y = &text_info[*(const Uint32*)b];
+    Uint32                  kx = TEXT_KEY(x->x, x->y, x->z), ky = TEXT_KEY(y->x, y->y, y->z);
+
+    /* pages of one place keep the order they have in the file */
+    if (kx != ky)
+        return kx < ky ? -1 : 1;
+    return *(const Uint32*)a < *(const Uint32*)b ? -1 : 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void build_text_index() {
+    Uint32                  i, count, slot, mask, key;
+    const text_info_t       *info;
+
+    /* collect the used entries, offset 0 is the empty padding string */
+    if ((text_pages = SDL_realloc(text_pages, NUM_STRINGS * sizeof(Uint32))) == NULL)
+        panic("SDL_realloc() failed!");
+    for (count = 0, i = 0; i < NUM_STRINGS; ++i)
+        if (text_info[i].offset != 0)
+            text_pages[count++] = i;
+    SDL_qsort(text_pages, count, sizeof(Uint32), compare_text_pages);
+
+    /* the hash table is at most half full */
+    for (text_index_bits = 4; (1u << text_index_bits) < count * 2; ++text_index_bits);
+    mask = (1u << text_index_bits) - 1;
+    if ((text_index = SDL_realloc(text_index, (mask + 1) * sizeof(text_range_t))) == NULL)
+        panic("SDL_realloc() failed!");
+    for (slot = 0; slot <= mask; ++slot)
+        text_index[slot].key = TEXT_NO_KEY;
+
+    /* one range per place, turn entry numbers into text offsets */
+    for (i = 0; i < count; ++i) {
+        info = &text_info[text_pages[i]];
+        key = TEXT_KEY(info->x, info->y, info->z);
+        for (slot = hash_text_key(key); (text_index[slot].key != TEXT_NO_KEY) && (text_index[slot].key != key); slot = (slot + 1) & mask);
+        if (text_index[slot].key == TEXT_NO_KEY) {
+            text_index[slot].key = key;
+            text_index[slot].first = i;
+            text_index[slot].count = 0;
+        }
+        ++text_index[slot].count;
+        text_pages[i] = info->offset;
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void unmap_world_file(const Uint8 *data, size_t size, int mapped) {
+#ifdef HAVE_MMAP
+    if (mapped)
+        munmap((void*)data, size);
+    else
+#endif
+        SDL_free((void*)data);
+    (void)size; (void)mapped;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void release_world_data() {
+    if (world_data == NULL)
+        return;
+    unmap_world_file(world_data, world_size, world_mapped);
+    world_data = NULL; world_size = 0; world_mapped = 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int map_world_file(const Uint8 **data, size_t *size, int *mapped) {
+    SDL_RWops               *rw;
+    Sint64                  length;
+    void                    *buffer;
+#ifdef HAVE_MMAP
+    int                     fd;
+    struct stat             st;
+
+    /* map the file privately, pages are only faulted in when touched; not
+       while watching it, a writer that rewrites it in place would change
+       or truncate the pages under the chunks still to be decoded */
+    if ((watch_fd < 0) && ((fd = open(world_file, O_RDONLY)) >= 0)) {
+        buffer = MAP_FAILED;
+        if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+            buffer = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (buffer != MAP_FAILED) {
+            *data = buffer; *size = (size_t)st.st_size; *mapped = 1;
+            return 1;
+        }
+    }
+#endif
+
+    /* otherwise read the whole file with a single call */
+    if ((rw = SDL_RWFromFile(world_file, "rb")) == NULL)
+        return 0;
+    if ((length = SDL_RWsize(rw)) <= 0) {
+        SDL_RWclose(rw);
+        SDL_SetError("%s is empty", world_file);
+        return 0;
+    }
+    if ((buffer = SDL_malloc((size_t)length)) == NULL)
+        panic("SDL_malloc() failed!");
+    if (SDL_RWread(rw, buffer, (size_t)length, 1) != 1) {
+        SDL_RWclose(rw);
+        SDL_free(buffer);
+        return 0;
+    }
+    SDL_RWclose(rw);
+    *data = buffer; *size = (size_t)length; *mapped = 0;
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void decode_text_info(const Uint8 *p, Uint32 count, Uint32 entry_size) {
+    Uint32                  i;
+
+    SDL_zero(text_info);
+    for (i = 0; i < count; ++i, p += entry_size) {
+        if (entry_size == INFO_ENTRY_SIZE) {
+            text_info[i].x = read_le16(p);
+            text_info[i].y = read_le16(p + 2);
+        } else {
+            text_info[i].x = p[0];
+            text_info[i].y = p[1];
+        }
+        text_info[i].z = p[entry_size - 3];
+        text_info[i].offset = read_le16(p + entry_size - 2);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void parse_legacy_world() {
+    const Uint8             *p = world_data;
+
+    if (world_size < LEGACY_WORLD_SIZE)
+        panic("%s is too small (%u of %u bytes)!", world_file, (unsigned)world_size, (unsigned)LEGACY_WORLD_SIZE);
+
+    /* map chunks are copied out of the planes when they are needed */
+    world_version = 0;
+    map_index = NULL;
+    map_tiles = p; p += 2 * 256 * 256;
+    map_codes = p; p += 2 * 256 * 256;
+    reset_map(2, LEGACY_MAP_SIZE, LEGACY_MAP_SIZE);
+
+    /* the strings are read-only and stay in the mapping */
+    text_data = (const char*)p; text_size = TEXT_DATA_SIZE; p += TEXT_DATA_SIZE;
+    decode_text_info(p, NUM_STRINGS, LEGACY_INFO_SIZE);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int find_world_section(const Uint8 *data, size_t size, const char *tag, world_section_t *section, const char **error) {
+    const Uint8             *entry = data + WORLD_HEADER_SIZE;
+    Uint32                  i, count, offset;
+
+    /* 0 with *error set if the entry is broken */
+    count = read_le16(data + 6);
+    for (i = 0; i < count; ++i, entry += WORLD_ENTRY_SIZE) {
+        if (SDL_memcmp(entry, tag, 4) != 0)
+            continue;
+        section->pack = read_le32(entry + 4);
+        offset = read_le32(entry + 8);
+        section->size = read_le32(entry + 12);
+        section->raw_size = read_le32(entry + 16);
+        if ((offset > size) || (section->size > size - offset))
+            *error = "is out of bounds";
+        else if ((section->pack == WORLD_PACK_RAW) && (section->size != section->raw_size))
+            *error = "has a bad size";
+        else if (section->pack > WORLD_PACK_RLE)
+            *error = "uses unknown packing";
+        else
+            section->data = data + offset;
+        return *error == NULL;
+    }
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int find_section(const char *tag, world_section_t *section) {
+    const char              *error = NULL;
+
+    if (find_world_section(world_data, world_size, tag, section, &error))
+        return 1;
+    if (error != NULL)
+        panic("%s: section %.4s %s!", world_file, tag, error);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const Uint8 *unpack_section(const char *tag, Uint8 *dst, int copy_raw, Uint32 min_size, Uint32 max_size, Uint32 *raw_size) {
+    world_section_t         section;
+
+    if (!find_section(tag, &section))
+        panic("%s has no %.4s section!", world_file, tag);
+    if ((section.raw_size < min_size) || (section.raw_size > max_size))
+        panic("%s: section %.4s has a bad size!", world_file, tag);
+    *raw_size = section.raw_size;
+
+    /* read-only raw sections are used straight from the mapping */
+    if (section.pack == WORLD_PACK_RAW) {
+        if (!copy_raw)
+            return section.data;
+        SDL_memcpy(dst, section.data, section.size);
+    } else if (!unpack_rle(section.data, section.size, dst, section.raw_size)) {
+        panic("%s: section %.4s is corrupt!", world_file, tag);
+    }
+    return dst;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int read_chunk_header(const world_section_t *section, int version, Uint32 *layers, Uint32 *cols, Uint32 *rows) {
+    Uint32                  header = (version >= 3) ? 8 : 4;
+
+    /* LE16 layers, LE16 chunk size, since version 3 LE16 columns and rows; 0 if it is broken */
+    if ((section->pack != WORLD_PACK_RAW) || (section->size < header))
+        return 0;
+    *layers = read_le16(section->data);
+    *cols = *rows = LEGACY_MAP_SIZE / MAP_CHUNK_SIZE;
+    if (version >= 3) {
+        *cols = read_le16(section->data + 4);
+        *rows = read_le16(section->data + 6);
+    }
+    if ((*layers < 1) || (*layers > MAX_LAYERS) || (read_le16(section->data + 2) != MAP_CHUNK_SIZE) ||
+        (*cols < 1) || (*cols > MAX_MAP_SIZE / MAP_CHUNK_SIZE) || (*rows < 1) || (*rows > MAX_MAP_SIZE / MAP_CHUNK_SIZE))
+        return 0;
+    return header;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void parse_map_chunks(const world_section_t *section) {
+    const Uint8             *entry;
+    Uint32                  i, header, layers, cols, rows, count, offset, size;
+
+    /* the header, then LE32 offset and size per chunk */
+    if ((header = read_chunk_header(section, world_version, &layers, &cols, &rows)) == 0)
+        panic("%s: section CHNK has a bad layout!", world_file);
+    count = layers * cols * rows;
+    if (header + count * 8 > section->size)
+        panic("%s: section CHNK is truncated!", world_file);
+    for (entry = section->data + header, i = 0; i < count; ++i, entry += 8) {
+        offset = read_le32(entry);
+        size = read_le32(entry + 4);
+        if ((size > MAP_CHUNK_BYTES) || (offset > section->size) || (size > section->size - offset))
+            panic("%s: map chunk %u is out of bounds!", world_file, i);
+    }
+
+    /* the chunks themselves are only unpacked when they are needed */
+    map_index = section->data;
+    map_header = header;
+    map_tiles = map_codes = NULL;
+    reset_map(layers, cols * MAP_CHUNK_SIZE, rows * MAP_CHUNK_SIZE);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void parse_map_planes() {
+    world_section_t         section;
+    Uint32                  layers, size;
+
+    /* one TILE and one CODE plane of 256x256 per layer, in any version */
+    if (!find_section("TILE", &section))
+        panic("%s has no map!", world_file);
+    layers = section.raw_size / (256 * 256);
+    if ((layers < 1) || (layers > MAX_LAYERS) || (section.raw_size % (256 * 256) != 0))
+        panic("%s: section TILE has a bad size!", world_file);
+    if ((section.pack != WORLD_PACK_RAW) && ((map_buffer = SDL_realloc(map_buffer, 2 * section.raw_size)) == NULL))
+        panic("SDL_realloc() failed!");
+    map_index = NULL;
+    map_tiles = unpack_section("TILE", map_buffer, 0, section.raw_size, section.raw_size, &size);
+    map_codes = unpack_section("CODE", map_buffer + section.raw_size, 0, section.raw_size, section.raw_size, &size);
+    reset_map(layers, LEGACY_MAP_SIZE, LEGACY_MAP_SIZE);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void parse_world() {
+    const Uint8             *info;
+    world_section_t         section;
+    Uint32                  count, size, entry_size;
+
+    world_version = read_le16(world_data + 4);
+    count = read_le16(world_data + 6);
+    if ((world_version < 2) || (world_version > WORLD_VERSION))
+        panic("%s has version %d, expected 2 to %d!", world_file, world_version, WORLD_VERSION);
+    if (count * WORLD_ENTRY_SIZE > world_size - WORLD_HEADER_SIZE)
+        panic("%s has a truncated section directory!", world_file);
+
+    if (find_section("CHNK", &section))
+        parse_map_chunks(&section);
+    else
+        parse_map_planes();
+    if (find_section("SPWN", &section)) {
+        entry_size = (world_version >= 3) ? SPAWN_ENTRY_SIZE : LEGACY_SPAWN_SIZE;
+        if ((section.pack != WORLD_PACK_RAW) || (section.size % entry_size != 0))
+            panic("%s: section SPWN has a bad size!", world_file);
+        spawn_list = section.data;
+        spawn_count = section.size / entry_size;
+    }
+    text_data = (const char*)unpack_section("TEXT", text_buffer, 0, 1, TEXT_DATA_SIZE, &text_size);
+    entry_size = (world_version >= 3) ? INFO_ENTRY_SIZE : LEGACY_INFO_SIZE;
+    info = unpack_section("INFO", info_buffer, 0, 0, NUM_STRINGS * entry_size, &size);
+    if (size % entry_size != 0)
+        panic("%s: section INFO has a bad size!", world_file);
+    decode_text_info(info, size / entry_size, entry_size);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void check_text() {
+    int                     i;
+
+    /* every string has to end inside the text section */
+    if (text_data[text_size - 1] != '\0')
+        panic("%s: text is not terminated!", world_file);
+    for (i = 0; i < NUM_STRINGS; ++i)
+        if (text_info[i].offset >= text_size)
+            panic("%s: string %d is out of bounds!", world_file, i);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int find_avatar(const Uint8 *codes, int width, int rows, int *spawns) {
+    int                     x, y;
+    Uint8                   code;
+
+    /* the walk of scan_spawn_codes(), the avatar also needs a free object slot */
+    for (y = 0; y < rows; ++y) {
+        for (x = 0; x < width; ++x) {
+            code = codes[y * width + x];
+            if (code == TILE_SIGNAL_TILE) {
+                ++x;
+            } else if (tile_is(code, TILE_IS_SPAWN)) {
+                if (tile_is(code, TILE_IS_AVATAR) && (*spawns < NUM_OBJECTS))
+                    return 1;
+                ++*spawns;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *section_error(const char *tag, const char *error) {
+    SDL_snprintf(check_error, sizeof(check_error), "section %.4s %s", tag, error);
+    return check_error;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *check_section(const Uint8 *data, size_t size, const char *tag, Uint32 min_size, Uint32 max_size, Uint8 **dst, Uint32 *raw_size) {
+    world_section_t         section;
+    const char              *error = NULL;
+
+    /* unpacks into a buffer of its own, the caller frees it */
+    *dst = NULL;
+    if (!find_world_section(data, size, tag, &section, &error))
+        return section_error(tag, (error != NULL) ? error : "is missing");
+    if ((section.raw_size < min_size) || (section.raw_size > max_size))
+        return section_error(tag, "has a bad size");
+    if ((*dst = SDL_malloc(section.raw_size + 1)) == NULL)
+        panic("SDL_malloc() failed!");
+    *raw_size = section.raw_size;
+    if (section.pack == WORLD_PACK_RAW)
+        SDL_memcpy(*dst, section.data, section.size);
+    else if (!unpack_rle(section.data, section.size, *dst, section.raw_size))
+        return section_error(tag, "is corrupt");
+    return NULL;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *check_map_chunks(const world_section_t *section, int version, int *layers, int *width, int *height, int *avatar) {
+    Uint8                   chunk[MAP_CHUNK_BYTES], *codes;
+    const Uint8             *entry;
+    Uint32                  header, num_layers, cols, rows, offset, size;
+    int                     z, cx, cy, y, spawns = 0;
+
+    if ((header = read_chunk_header(section, version, &num_layers, &cols, &rows)) == 0)
+        return "section CHNK has a bad layout";
+    if (header + num_layers * cols * rows * 8 > section->size)
+        return "section CHNK is truncated";
+    *layers = num_layers;
+    *width = cols * MAP_CHUNK_SIZE; *height = rows * MAP_CHUNK_SIZE;
+
+    /* every chunk has to unpack, the game only finds out when one is first touched */
+    if ((codes = SDL_malloc(*width * *height)) == NULL)
+        panic("SDL_malloc() failed!");
+    for (entry = section->data + header, z = 0; z < *layers; ++z) {
+        SDL_memset(codes, 0, *width * *height);
+        for (cy = 0; cy < (int)rows; ++cy) {
+            for (cx = 0; cx < (int)cols; ++cx, entry += 8) {
+                offset = read_le32(entry);
+                size = read_le32(entry + 4);
+                if ((size > MAP_CHUNK_BYTES) || (offset > section->size) || (size > section->size - offset) ||
+                    ((size > 0) && (size < MAP_CHUNK_BYTES) && !unpack_rle(section->data + offset, size, chunk, MAP_CHUNK_BYTES))) {
+                    SDL_free(codes);
+                    return "a map chunk is corrupt";
+                }
+                if (size == 0)
+                    continue;
+                if (size == MAP_CHUNK_BYTES)
+                    SDL_memcpy(chunk, section->data + offset, MAP_CHUNK_BYTES);
+                for (y = 0; y < MAP_CHUNK_SIZE; ++y)
+                    SDL_memcpy(&codes[((cy << MAP_CHUNK_SHIFT) + y) * *width + (cx << MAP_CHUNK_SHIFT)],
+                               &chunk[(MAP_CHUNK_SIZE + y) * MAP_CHUNK_SIZE], MAP_CHUNK_SIZE);
+            }
+        }
+        if (!*avatar)
+            *avatar = find_avatar(codes, *width, *height, &spawns);
+    }
+    SDL_free(codes);
+    return NULL;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *check_map_planes(const Uint8 *data, size_t size, int *layers, int *avatar) {
+    Uint8                   *tiles, *codes = NULL;
+    Uint32                  tiles_size, codes_size;
+    const char              *error;
+    int                     spawns = 0;
+
+    error = check_section(data, size, "TILE", 256 * 256, MAX_LAYERS * 256 * 256, &tiles, &tiles_size);
+    if ((error == NULL) && (tiles_size % (256 * 256) != 0))
+        error = section_error("TILE", "has a bad size");
+    if (error == NULL)
+        error = check_section(data, size, "CODE", tiles_size, tiles_size, &codes, &codes_size);
+    if (error == NULL) {
+        *layers = tiles_size / (256 * 256);
+        *avatar = find_avatar(codes, 256, *layers * 256, &spawns);
+    }
+    SDL_free(tiles);
+    SDL_free(codes);
+    return error;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int read_spawn(const Uint8 *p, int version, int *x, int *y) {
+    /* the layer of the entry */
+    if (version >= 3) {
+        *x = read_le16(p + 1); *y = read_le16(p + 3);
+        return p[5];
+    }
+    *x = p[1]; *y = p[2];
+    return p[3];
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *check_spawn_list(const Uint8 *data, size_t size, int version, int layers, int width, int height, int *avatar) {
+    world_section_t         section;
+    const char              *error = NULL;
+    const Uint8             *p;
+    Uint32                  i, entry_size = (version >= 3) ? SPAWN_ENTRY_SIZE : LEGACY_SPAWN_SIZE;
+    int                     x, y;
+
+    /* without a list the avatar found in the map counts */
+    if (!find_world_section(data, size, "SPWN", &section, &error))
+        return (error != NULL) ? section_error("SPWN", error) : NULL;
+    if ((section.pack != WORLD_PACK_RAW) || (section.size % entry_size != 0))
+        return "section SPWN has a bad size";
+    for (*avatar = 0, i = 0; i < section.size / entry_size; ++i) {
+        p = section.data + i * entry_size;
+        if (!tile_is(p[0], TILE_IS_SPAWN) || (read_spawn(p, version, &x, &y) >= layers) || (x >= width) || (y >= height))
+            return "section SPWN has an invalid spawn";
+        if (tile_is(p[0], TILE_IS_AVATAR) && (i < NUM_OBJECTS))
+            *avatar = 1;
+    }
+    return NULL;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *check_text_sections(const Uint8 *data, size_t size, int version) {
+    Uint8                   *text, *info = NULL;
+    Uint32                  text_size, info_size, i, entry_size = (version >= 3) ? INFO_ENTRY_SIZE : LEGACY_INFO_SIZE;
+    const char              *error;
+
+    error = check_section(data, size, "TEXT", 1, TEXT_DATA_SIZE, &text, &text_size);
+    if ((error == NULL) && (text[text_size - 1] != '\0'))
+        error = "text is not terminated";
+    if (error == NULL)
+        error = check_section(data, size, "INFO", 0, NUM_STRINGS * entry_size, &info, &info_size);
+    if ((error == NULL) && (info_size % entry_size != 0))
+        error = section_error("INFO", "has a bad size");
+    for (i = 0; (error == NULL) && (i < info_size); i += entry_size)
+        if (read_le16(info + i + entry_size - 2) >= text_size)
+            error = "a string is out of bounds";
+    SDL_free(text);
+    SDL_free(info);
+    return error;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const char *check_world_file(const Uint8 *data, size_t size) {
+    world_section_t         section;
+    const char              *error = NULL;
+    int                     version, layers = 0, width = LEGACY_MAP_SIZE, height = LEGACY_MAP_SIZE, avatar = 0, spawns = 0;
+
+    /* everything load_world() and the chunk loader would panic about, without touching the world */
+    if ((size < WORLD_HEADER_SIZE) || (SDL_memcmp(data, WORLD_MAGIC, 4) != 0)) {
+        if (size < LEGACY_WORLD_SIZE)
+            return "it is too small";
+        if (data[2 * 2 * 256 * 256 + TEXT_DATA_SIZE - 1] != '\0')
+            return "text is not terminated";
+        return find_avatar(data + 2 * 256 * 256, 256, 2 * 256, &spawns) ? NULL : "it has no avatar";
+    }
+    if (((version = read_le16(data + 4)) < 2) || (version > WORLD_VERSION))
+        return "it has another version";
+    if (read_le16(data + 6) * WORLD_ENTRY_SIZE > size - WORLD_HEADER_SIZE)
+        return "its section directory is truncated";
+
+    if (find_world_section(data, size, "CHNK", &section, &error))
+        error = check_map_chunks(&section, version, &layers, &width, &height, &avatar);
+    else if (error != NULL)
+        error = section_error("CHNK", error);
+    else
+        error = check_map_planes(data, size, &layers, &avatar);
+    if (error == NULL)
+        error = check_spawn_list(data, size, version, layers, width, height, &avatar);
+    if (error == NULL)
+        error = check_text_sections(data, size, version);
+    if ((error == NULL) && !avatar)
+        error = "it has no avatar";
+    return error;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void spawn_listed_objects() {
+    const Uint8             *p = spawn_list;
+    Uint32                  i;
+    int                     x, y, z;
+
+    /* in the order scan_spawn_codes() would find them */
+    for (i = 0; i < spawn_count; ++i, p += (world_version >= 3) ? SPAWN_ENTRY_SIZE : LEGACY_SPAWN_SIZE) {
+        z = read_spawn(p, world_version, &x, &y);
+        if (!tile_is(p[0], TILE_IS_SPAWN) || (z >= num_layers) || (x >= map_width) || (y >= map_height))
+            panic("%s: spawn %u is invalid, rebake the world!", world_file, i);
+        spawn_object(p[0], x, y, z);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void scan_spawn_codes() {
+    int                     x, y, z, id, cx;
+    const map_chunk_t       *chunk = NULL;
+
+    for (z = 0; z < num_layers; ++z) {
+        for (y = 0; y < map_height; ++y) {
+            for (cx = -1, x = 0; x < map_width; ++x) {
+                /* one chunk lookup per 32 tiles, empty chunks are skipped */
+                if ((x >> MAP_CHUNK_SHIFT) != cx) {
+                    cx = x >> MAP_CHUNK_SHIFT;
+                    if ((chunk = find_chunk(x, y, z)) == &empty_chunk) {
+                        x |= MAP_CHUNK_MASK;
+                        continue;
+                    }
+                }
+                id = chunk->codes[y & MAP_CHUNK_MASK][x & MAP_CHUNK_MASK];
+                if (id == TILE_SIGNAL_TILE) {
+                    ++x;
+                } else if (tile_is(id, TILE_IS_SPAWN)) {
+                    spawn_object(id, x, y, z);
+                    cx = -1;
+                }
+            }
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void reset_world() {
+    /* reset all data */
+    SDL_zero(objects);
+    SDL_zero(avatar);
+    SDL_zero(hurt_states);
+    dead_objects.count = hurt_objects.count = 0;
+    reset_object_slots();
+    pool_exhausted = 0;
+    story_text = NULL;
+    invalidate_layer(SCREEN_LAYER_WORLD);
+
+    /* rebuild everything from the world data in memory */
+    spawn_list = NULL; spawn_count = 0;
+    if ((world_size >= WORLD_HEADER_SIZE) && (SDL_memcmp(world_data, WORLD_MAGIC, 4) == 0))
+        parse_world();
+    else
+        parse_legacy_world();
+    reset_chunks();
+    check_text();
+    build_text_index();
+
+    /* spawn objects, from the baked list unless the world predates it */
+    if (spawn_list != NULL)
+        spawn_listed_objects();
+    else
+        scan_spawn_codes();
+
+    if (avatar.obj == NULL)
+        panic("World has no avatar!");
+    SDL_memcpy(pristine_objects, objects, sizeof(objects));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void install_world(const Uint8 *data, size_t size, int mapped) {
+    /* replace the previous mapping */
+    spawn_list = NULL; spawn_count = 0;
+    release_world_data();
+    world_data = data; world_size = size; world_mapped = mapped;
+    reset_world();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void count_world_load(Uint64 start) {
+    double                  ms;
+
+    ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    if (load_stats.loads++ == 0) {
+        load_stats.first = load_stats.min = load_stats.max = ms;
     } else {
-        obj->life = 0;
-        objmap[obj->z][obj->y][obj->x] = 0;
+        if ((load_stats.loads == 2) || (ms < load_stats.min)) load_stats.min = ms;
+        if ((load_stats.loads == 2) || (ms > load_stats.max)) load_stats.max = ms;
     }
+    load_stats.last = ms;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void load_world() {
+    const Uint8             *data;
+    size_t                  size;
+    int                     mapped;
+    Uint64                  start;
+
+    start = SDL_GetPerformanceCounter();
+    if (!map_world_file(&data, &size, &mapped))
+        panic("Can't read %s: %s", world_file, SDL_GetError());
+    install_world(data, size, mapped);
+    count_world_load(start);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void visit_power_tile(Uint8 x, Uint8 y, Uint8 z) {
-    object_t                *obj;
-    int                     id;
+static int read_checked_world(const char *action, const Uint8 **data, size_t *size, int *mapped) {
+    const char              *error;
 
-    switch (codemap[z][y][x]) {
-        case TILE_SIGNAL_OFF:
-            codemap[z][y][x] = TILE_SIGNAL_ON;
-            visit_power_tile(x, y - 1, z);
-            visit_power_tile(x + 1, y, z);
-            visit_power_tile(x, y + 1, z);
-            visit_power_tile(x - 1, y, z);            
-            return;
-        case TILE_SIGNAL_AND:
-            if ((codemap[z][(y - 1) & 255][x] == TILE_SIGNAL_ON) && (codemap[z][(y + 1) & 255][x] == TILE_SIGNAL_ON))
-                visit_power_tile(x + 1, y, z);
-            return;
-        case TILE_SIGNAL_OR:
-            if ((codemap[z][(y - 1) & 255][x] == TILE_SIGNAL_ON) || (codemap[z][(y + 1) & 255][x] == TILE_SIGNAL_ON))
-                visit_power_tile(x + 1, y, z);
-            return;
-        case TILE_SIGNAL_TILE:
-            id = codemap[z][y][(x + 1) & 255];
-            codemap[z][y][(x + 1) & 255] = tilemap[z][y][(x + 1) & 255];
-            tilemap[z][y][(x + 1) & 255] = id;
-            return;
+    /* a file the game can't use is left alone, the current world goes on */
+    if (!map_world_file(data, size, mapped)) {
+        SDL_Log("Not %s %s: %s", action, world_file, SDL_GetError());
+        return 0;
     }
-
-    if ((id = objmap[z][y][x]) > 0) {
-        obj = &objects[id - 1];
-        if (obj->picture == TILE_FLAG_OFF) {
-            obj->picture = TILE_FLAG_ON;
-        } else if (obj->picture == TILE_DOOR_MAGIC) {
-            obj->picture = TILE_DOOR_CLOSED;
-        }
+    if ((error = check_world_file(*data, *size)) != NULL) {
+        SDL_Log("Not %s %s, %s", action, world_file, error);
+        unmap_world_file(*data, *size, *mapped);
+        return 0;
     }
+    return 1;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void power_tile(Uint8 x, Uint8 y, Uint8 z) {
-    visit_power_tile(x, y - 1, z);
-    visit_power_tile(x + 1, y, z);
-    visit_power_tile(x, y + 1, z);
-    visit_power_tile(x - 1, y, z);
+static int restart_world() {
+    const Uint8             *data;
+    size_t                  size;
+    int                     mapped;
+    Uint64                  start;
+
+    start = SDL_GetPerformanceCounter();
+    if (!read_checked_world("restarting", &data, &size, &mapped))
+        return 0;
+    install_world(data, size, mapped);
+    count_world_load(start);
+    return 1;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int_fast8_t move_monster(object_t *obj, int dx, int dy) {
-    Uint8                   new_x, new_y;
-    int                     id, damage;
-    object_t                *dst;
+static void push_inputs(int btn_mask, int btnp_mask, int count) {
+    input_t                 *in;
+
+    if ((inputs = SDL_realloc(inputs, (num_inputs + count) * sizeof(input_t))) == NULL)
+        panic("SDL_realloc() failed!");
+    for (in = &inputs[num_inputs]; count > 0; --count, ++in, ++num_inputs) {
+        in->btn = (Uint8)btn_mask;
+        in->btnp = (Uint8)btnp_mask;
+    }
+}
 
-    new_x = obj->x + dx;
-    new_y = obj->y + dy;
 
-    if ((id = objmap[obj->z][new_y][new_x]) > 0) {
-        dst = &objects[id - 1];
-        if ((dst->picture >= TILE_AVATAR_0) && (dst->picture <= TILE_AVATAR_1)) {
-            damage = (obj->picture - TILE_MONSTER_FIRST) * 2 + 1;
-            if (avatar.armor > 0) {
-                if ((damage -= avatar.armor * 2) < 1)
-                    damage = 1;
-                if (--avatar.armor_life == 0)
-                    avatar.armor = 0;
+/*----------------------------------------------------------------------------*/
+static void load_script(const char *filename) {
+    char                    *data, *line, *next, *end;
+    int                     mask, prev, line_no;
+    long                    count;
+
+    if ((data = SDL_LoadFile(filename, NULL)) == NULL)
+        panic("SDL_LoadFile() failed: %s", SDL_GetError());
+
+    /* every line is "<buttons> [ticks]" with buttons out of UDLRAB or - */
+    for (prev = 0, line = data, line_no = 1; *line; line = next, ++line_no) {
+        for (next = line; (*next != '\0') && (*next != '\n'); ++next);
+        if (*next) *next++ = '\0';
+        while ((*line == ' ') || (*line == '\t')) ++line;
+        if ((*line == '\0') || (*line == '\r') || (*line == '#'))
+            continue;
+
+        for (mask = 0; (*line != '\0') && (*line != ' ') && (*line != '\t') && (*line != '\r'); ++line) {
+            switch (*line) {
+                case 'U':   mask |= BUTTON_UP; break;
+                case 'D':   mask |= BUTTON_DOWN; break;
+                case 'L':   mask |= BUTTON_LEFT; break;
+                case 'R':   mask |= BUTTON_RIGHT; break;
+                case 'A':   mask |= BUTTON_A; break;
+                case 'B':   mask |= BUTTON_B; break;
+                case '-':   break;
+                default:    panic("%s:%d: invalid button '%c'", filename, line_no, *line);
             }
-            hurt_object(dst, damage);
         }
-        return 0;
+        count = SDL_strtol(line, &end, 10);
+        if (end == line)
+            count = 1;
+        else if ((count < 1) || (count > 1 << 20))
+            panic("%s:%d: invalid tick count", filename, line_no);
+
+        push_inputs(mask, mask & ~prev, 1);
+        if (count > 1)
+            push_inputs(mask, 0, count - 1);
+        prev = mask;
     }
-    id = tilemap[obj->z][new_y][new_x];
-    if ((id < TILE_FLOOR_FIRST) || (id > TILE_FLOOR_LAST))
-        return 0;
-    
-    move_object(obj, new_x, new_y, obj->z);
-    return 1;
+
+    SDL_free(data);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_object_turn(object_t *obj) {
-    if ((obj->picture >= TILE_MONSTER_FIRST) && (obj->picture <= TILE_MONSTER_LAST)) {
-        int                 ax, ay;
+static void load_replay(const char *filename) {
+    Uint8                   *data;
+    size_t                  size, i;
 
-        if ((obj->life == 0) || (obj->z != avatar.obj->z))
-            return;
+    if ((data = SDL_LoadFile(filename, &size)) == NULL)
+        panic("SDL_LoadFile() failed: %s", SDL_GetError());
+    if ((size < 5) || (SDL_memcmp(data, "XREC", 4) != 0) || (data[4] != 1) || ((size - 5) % 3 != 0))
+        panic("%s is not a valid recording!", filename);
 
-        ax = avatar.obj->x; ay = avatar.obj->y;
-        if ((SDL_abs(obj->x - ax) > 8) || (SDL_abs(obj->y - ay) > 8))
-            return;
+    /* runs of (btn | INPUT_RELOAD, btnp, ticks) */
+    for (i = 5; i < size; i += 3)
+        push_inputs(data[i], data[i + 1], data[i + 2]);
 
-        if (rand16()&1) {
-            if      (obj->x < ax) move_monster(obj, 1, 0);
-            else if (obj->x > ax) move_monster(obj, -1, 0);
-        } else {
-            if      (obj->y < ay) move_monster(obj, 0, 1);
-            else if (obj->y > ay) move_monster(obj, 0, -1);
-        }
-    }
+    SDL_free(data);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void handle_all_objects() {
-    int                     i;
-    for (i = 0; i < NUM_OBJECTS; ++i)
-        on_object_turn(&objects[i]);
+static int flush_recording() {
+    Uint8                   run[3];
+
+    /* the run is gone before it is written, a failed write is never retried */
+    if (record_count == 0)
+        return 1;
+    run[0] = record_input.btn;
+    run[1] = record_input.btnp;
+    run[2] = (Uint8)record_count;
+    record_count = 0;
+    return SDL_RWwrite(record_rw, run, sizeof(run), 1) == 1;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void move_avatar(int dx, int dy) {
-    object_t                *obj, *dst;
-    Uint8                   new_x, new_y, new_z;
-    int                     id, sight;
+static void start_recording(const char *filename) {
+    if ((record_rw = SDL_RWFromFile(filename, "wb")) == NULL)
+        panic("SDL_RWFromFile() failed: %s", SDL_GetError());
+    if (SDL_RWwrite(record_rw, "XREC\1", 5, 1) != 1)
+        panic("SDL_RWwrite() failed: %s", SDL_GetError());
+}
 
-    obj = avatar.obj;
-    new_x = obj->x + dx;
-    new_y = obj->y + dy;
-    new_z = obj->z;
 
-    if ((id = objmap[new_z][new_y][new_x]) > 0) {
-        dst = &objects[id - 1];
-        if ((dst->picture >= TILE_MONSTER_FIRST) && (dst->picture <= TILE_MONSTER_LAST)) {
-            hurt_object(dst, avatar.sword * 2 + 1);
-            if (avatar.sword_life > 0) {
-                if (--avatar.sword_life == 0)
-                    avatar.sword = 0;
-            }
-            if (dst->life == 0)
-                spawn_object_nearby(TILE_MONEY, dst->x, dst->y, dst->z);
-        } else if ((dst->picture == TILE_MONEY) && (avatar.money < 255)) {
-            int     money = avatar.money + dice6() + dice6();
-            if (money > 255) money = 255;
-            avatar.money = money;
-            remove_object(dst);
-        } else if ((dst->picture == TILE_KEY) && (avatar.keys < 8)) {
-            ++avatar.keys;
-            remove_object(dst);
-        } else if (dst->picture == TILE_FLAG_OFF) {
-            power_tile(dst->x, dst->y, dst->z);
-        } else if (dst->picture == TILE_CHEST_OPEN) {
-            dst->picture = TILE_CHEST_CLOSED;
-            spawn_object_nearby(TILE_MONEY, dst->x, dst->y, dst->z);
-        } else if (dst->picture == TILE_DOOR_CLOSED) {
-            objmap[dst->z][dst->y][dst->x] = 0;
-            tilemap[dst->z][dst->y][dst->x] = TILE_DOOR_OPEN;
-        } else if ((dst->picture == TILE_DOOR_LOCKED) && (avatar.keys > 0)) {
-            obj->picture = TILE_DOOR_CLOSED;
-            --avatar.keys;
-        }
+/*----------------------------------------------------------------------------*/
+static void record_tick_input() {
+    input_t                 in;
+
+    in.btn = (Uint8)(btn | (record_reload ? INPUT_RELOAD : 0));
+    in.btnp = (Uint8)btnp;
+    record_reload = 0;
+
+    if ((record_count > 0) && (record_count < 255) &&
+        (in.btn == record_input.btn) && (in.btnp == record_input.btnp)) {
+        ++record_count;
         return;
     }
-    id = tilemap[new_z][new_y][new_x];
-    if ((id < TILE_FLOOR_FIRST) || (id > TILE_FLOOR_LAST)) {
-        switch (id) {
-            case TILE_DOCK:
-                avatar.sail_x = new_x - obj->x;
-                avatar.sail_y = new_y - obj->y;
-                ask_question(GAME_STATE_SAIL, GAME_STATE_PLAY, "Do you want to sail?");
-                break;
-            case TILE_FIRE_PLACE:
-                ask_question(GAME_STATE_REST, GAME_STATE_PLAY, "A cosy fireplace.\nDo you want to rest?");
-                return;
-            case TILE_SIGN_POST:
-            case TILE_STORY_0:
-            case TILE_STORY_1:
-            case TILE_STORY_2:
-            case TILE_STORY_3:
-                story_x = new_x; story_y = new_y; story_z = new_z;
-                story_text = NULL; story_page = 0;
-                enter_state(GAME_STATE_STORY);
-                return;
-            case TILE_HEALER_0:
-            case TILE_HEALER_1:
-                enter_state(GAME_STATE_HEALER);
-                return;
-            case TILE_SMITH_0:
-            case TILE_SMITH_1:
-                enter_state(GAME_STATE_SMITH);
-                return;
-            case TILE_TAVERN_0:
-            case TILE_TAVERN_1:
-                enter_state(GAME_STATE_TAVERN);
-                return;
-            default:
-                return;
+    if (!flush_recording())
+        panic("SDL_RWwrite() failed: %s", SDL_GetError());
+    record_input = in;
+    record_count = 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void stop_recording() {
+    SDL_RWops               *rw = record_rw;
+    int                     ok;
+
+    /* this also runs from atexit(), so a failure is only logged */
+    if (rw == NULL)
+        return;
+    ok = flush_recording();
+    record_rw = NULL;
+    if ((SDL_RWclose(rw) != 0) || !ok)
+        SDL_Log("Can't write %s: %s", record_file, SDL_GetError());
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint64 hash_bytes(Uint64 hash, const void *data, size_t size) {
+    const Uint8             *p = data;
+
+    /* FNV-1a */
+    for (; size > 0; --size, ++p)
+        hash = (hash ^ *p) * 0x100000001b3ull;
+    return hash;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint64 hash_map(Uint64 hash, int plane) {
+    int                     z, y, x;
+    const map_chunk_t       *chunk;
+
+    /* row by row, so the hash matches one of plain [z][y][x] arrays */
+    for (z = 0; z < num_layers; ++z) {
+        for (y = 0; y < map_height; ++y) {
+            for (x = 0; x < map_width; x += MAP_CHUNK_SIZE) {
+                chunk = find_chunk(x, y, z);
+                switch (plane) {
+                    case 0: hash = hash_bytes(hash, chunk->tiles[y & MAP_CHUNK_MASK], sizeof(chunk->tiles[0])); break;
+                    case 1: hash = hash_bytes(hash, chunk->codes[y & MAP_CHUNK_MASK], sizeof(chunk->codes[0])); break;
+                    case 2: hash = hash_bytes(hash, chunk->objs[y & MAP_CHUNK_MASK], sizeof(chunk->objs[0])); break;
+                }
+            }
         }
     }
+    return hash;
+}
 
-    move_object(obj, new_x, new_y, new_z);
 
-    /* adjust torch life */
-    sight = obj->z == 0 ? light_radius[avatar.time] : 1;
-    if ((sight < TORCH_LIGHT_RADIUS) && (avatar.torch > 0))
-        --avatar.torch;
+/*----------------------------------------------------------------------------*/
+static Uint64 hash_state() {
+    Uint64                  hash = 0xcbf29ce484222325ull;
+    Uint16                  avatar_id;
+
+    hash = hash_map(hash, 0);
+    hash = hash_map(hash, 1);
+    hash = hash_map(hash, 2);
+    hash = hash_bytes(hash, objects, sizeof(objects));
+
+    /* hash the avatar field by field to skip the pointer and padding */
+    avatar_id = avatar.obj->id;
+    hash = hash_bytes(hash, &avatar_id, sizeof(avatar_id));
+    hash = hash_bytes(hash, &avatar.money, 1);
+    hash = hash_bytes(hash, &avatar.keys, 1);
+    hash = hash_bytes(hash, &avatar.torch, 1);
+    hash = hash_bytes(hash, &avatar.time, 1);
+    hash = hash_bytes(hash, &avatar.sword, 1);
+    hash = hash_bytes(hash, &avatar.sword_life, 1);
+    hash = hash_bytes(hash, &avatar.armor, 1);
+    hash = hash_bytes(hash, &avatar.armor_life, 1);
+    hash = hash_bytes(hash, avatar.potions, sizeof(avatar.potions));
+    hash = hash_bytes(hash, &avatar.sail_x, 1);
+    hash = hash_bytes(hash, &avatar.sail_y, 1);
+    hash = hash_bytes(hash, &avatar.seed, sizeof(avatar.seed));
+    return hash;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int on_avatar_turn() {
-    if (btn & BUTTON_UP) {
-        move_avatar(0, -1);
-        return 1;
-    } else if (btn & BUTTON_DOWN) {
-        move_avatar(0, 1);
-        return 1;
-    } else if (btn & BUTTON_LEFT) {
-        move_avatar(-1, 0);
-        return 1;
-    } else if (btn & BUTTON_RIGHT) {
-        move_avatar(1, 0);
-        return 1;
-    }
-    return 0;
+static Uint32 hash_world() {
+    return (Uint32)hash_bytes(0xcbf29ce484222325ull, world_data, world_size);
 }
 
 
-/*
-================================================================================
+/*----------------------------------------------------------------------------*/
+static int is_on_map(const object_t *obj) {
+    return (obj->picture != 0) && (get_obj(obj->x, obj->y, obj->z) == obj->id + 1);
+}
 
-        GAME STATE FUNCTIONS
 
-================================================================================
-*/
 /*----------------------------------------------------------------------------*/
-static void on_nightfall() {
-    int                     i;
-    for (i = 0; i < NUM_OBJECTS; ++i)
-        respawn_object(&objects[i]);
+static int is_changed(const object_t *obj, const object_t *pristine, int on_map) {
+    /* everything spawned by load_world() starts on the map */
+    return (SDL_memcmp(obj, pristine, sizeof(object_t)) != 0) || (on_map != (pristine->picture != 0));
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void advance_time(int turns) {
-    for (; turns > 0; --turns) {
-        ++avatar.time;
-        if (avatar.time == 0) {             /* jump out of resting... */
-            enter_state(GAME_STATE_PLAY);
-            return;
-        } else if (avatar.time == 192) {    /* midnight */
-            on_nightfall();
-        }
-    }
+static void lift_object(Uint16 id) {
+    if (objects[id].picture != 0)
+        clear_obj(objects[id].x, objects[id].y, objects[id].z, id + 1);
+    unlink_object(id);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_game_state_play() {
-    int                     i;
+static void place_object(Uint16 id, const object_t *src, int on_map) {
+    object_t                *obj = &objects[id];
 
-    /* advance hurt states */
-    for (i = 0; i < NUM_OBJECTS; ++i)
-        if (hurt_states[i] > 0)
-            --hurt_states[i];
+    *obj = *src;
+    if (obj->picture == 0)
+        return;
+    link_object(obj);
+    if (on_map)
+        set_obj(obj->x, obj->y, obj->z, id + 1);
+}
 
-    if (on_avatar_turn()) {
-        handle_all_objects();
-        advance_time(1);
+
+/*----------------------------------------------------------------------------*/
+static void write_save_bytes(SDL_RWops *rw, const void *data, size_t size) {
+    /* the first failure is kept, save_game() gives up on the file then */
+    if (!save_failed && (SDL_RWwrite(rw, data, size, 1) != 1)) {
+        SDL_Log("SDL_RWwrite() failed: %s", SDL_GetError());
+        save_failed = 1;
     }
+}
 
-    clear_screen();
-    draw_map();
-    draw_hud();
+
+/*----------------------------------------------------------------------------*/
+static void copy_chunk_bytes(const map_chunk_t *chunk, Uint8 *data) {
+    SDL_memcpy(data, chunk->tiles, sizeof(chunk->tiles));
+    SDL_memcpy(data + sizeof(chunk->tiles), chunk->codes, sizeof(chunk->codes));
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_game_state_rest(const int heal) {
-    if (btnp & BUTTON_B) {
-        enter_state(GAME_STATE_PLAY);
+static void write_chunk_delta(SDL_RWops *rw, const map_chunk_t *chunk, int cx, int cy, int z) {
+    Uint8                   data[MAP_CHUNK_BYTES], pristine[MAP_CHUNK_BYTES], head[3];
+    int                     i, j, end;
+
+    copy_chunk_bytes(chunk, data);
+    if (!read_map_chunk(cx, cy, z, pristine))
+        SDL_zero(pristine);
+
+    head[0] = (Uint8)z; head[1] = (Uint8)cx; head[2] = (Uint8)cy;
+    write_save_bytes(rw, head, 3);
+
+    /* runs of changed bytes, gaps shorter than a run header are bridged */
+    for (i = 0; i < MAP_CHUNK_BYTES;) {
+        if (data[i] == pristine[i]) {
+            ++i;
+            continue;
+        }
+        for (end = j = i + 1; (j < MAP_CHUNK_BYTES) && (j - i < SAVE_RUN_MAX) && (j - end < 3); ++j)
+            if (data[j] != pristine[j])
+                end = j + 1;
+        write_le16(head, i);
+        head[2] = (Uint8)(end - i);
+        write_save_bytes(rw, head, 3);
+        write_save_bytes(rw, data + i, end - i);
+        i = end;
+    }
+    SDL_zero(head);
+    write_save_bytes(rw, head, 3);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void save_game() {
+    char                    tmp[1024];
+    SDL_RWops               *rw;
+    Uint8                   buf[SAVE_AVATAR_SIZE];
+    const map_chunk_t       *chunk;
+    const object_t          *obj;
+    Uint32                  hash;
+    int                     i, count, on_map, size;
+
+    /* the old save stays until the new one is complete, a failure only loses this save */
+    SDL_snprintf(tmp, sizeof(tmp), "%s.tmp", save_file);
+    if ((rw = SDL_RWFromFile(tmp, "wb")) == NULL) {
+        SDL_Log("Can't save to %s: %s", tmp, SDL_GetError());
         return;
     }
-    if ((heal) && (avatar.obj->life < 15))
-        ++avatar.obj->life;
-    handle_all_objects();
-    advance_time(8);
+    save_failed = 0;
+
+    /* a save only fits the world it was made in */
+    SDL_memcpy(buf, SAVE_MAGIC, 4);
+    buf[4] = SAVE_VERSION;
+    hash = hash_world();
+    write_le16(buf + 5, hash);
+    write_le16(buf + 7, hash >> 16);
+    write_save_bytes(rw, buf, SAVE_HEADER_SIZE);
+
+    write_le16(buf, avatar.obj->id);
+    buf[2] = avatar.money;      buf[3] = avatar.keys;
+    buf[4] = avatar.torch;      buf[5] = avatar.time;
+    buf[6] = avatar.sword;      buf[7] = avatar.sword_life;
+    buf[8] = avatar.armor;      buf[9] = avatar.armor_life;
+    buf[10] = avatar.potions[0];
+    buf[11] = avatar.potions[1];
+    buf[12] = (Uint8)avatar.sail_x;
+    buf[13] = (Uint8)avatar.sail_y;
+    write_le16(buf + 14, avatar.seed);
+    write_save_bytes(rw, buf, SAVE_AVATAR_SIZE);
+
+    /* only written chunks can differ from the world file */
+    for (count = i = 0; i < num_layers * map_cols * map_rows; ++i)
+        if ((map_slots[i] != NULL) && map_slots[i]->dirty)
+            ++count;
+    write_le16(buf, count);
+    write_save_bytes(rw, buf, 2);
+    for (i = 0; i < num_layers * map_cols * map_rows; ++i) {
+        chunk = map_slots[i];
+        if ((chunk != NULL) && chunk->dirty)
+            write_chunk_delta(rw, chunk, i % map_cols, i / map_cols % map_rows, i / (map_cols * map_rows));
+    }
 
-    clear_screen();
-    draw_map();
-    draw_hud();
+    /* objects that moved, changed or left the map since they were spawned */
+    for (count = i = 0; i < NUM_OBJECTS; ++i)
+        if (is_changed(&objects[i], &pristine_objects[i], is_on_map(&objects[i])))
+            ++count;
+    write_le16(buf, count);
+    write_save_bytes(rw, buf, 2);
+    for (i = 0; i < NUM_OBJECTS; ++i) {
+        obj = &objects[i];
+        on_map = is_on_map(obj);
+        if (!is_changed(obj, &pristine_objects[i], on_map))
+            continue;
+        write_le16(buf, i);
+        buf[2] = obj->picture;
+        write_le16(buf + 3, obj->x);        write_le16(buf + 5, obj->y);        buf[7] = obj->z;
+        write_le16(buf + 8, obj->spawn_x);  write_le16(buf + 10, obj->spawn_y); buf[12] = obj->spawn_z;
+        buf[13] = obj->life;
+        buf[14] = (Uint8)on_map;
+        write_save_bytes(rw, buf, SAVE_OBJECT_SIZE);
+    }
 
-    draw_box(2, 2, SCREEN_COLS - 6, 1);
-    draw_textf(3, 3, "Resting ... %c to cancel", TILE_BUTTON_B);
+    write_le16(buf, hurt_objects.count);
+    write_save_bytes(rw, buf, 2);
+    for (i = 0; i < hurt_objects.count; ++i) {
+        write_le16(buf, hurt_objects.ids[i]);
+        buf[2] = hurt_states[hurt_objects.ids[i]];
+        write_save_bytes(rw, buf, 3);
+    }
+
+    /* a buffered write can still fail while seeking or closing */
+    size = (int)SDL_RWtell(rw);
+    if ((SDL_RWclose(rw) != 0) || save_failed || (size < 0) || (rename(tmp, save_file) != 0)) {
+        SDL_Log("Can't save to %s, the previous save is kept", save_file);
+        remove(tmp);
+        return;
+    }
+    SDL_Log("Saved to %s (%d bytes)", save_file, size);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_game_state_sail() {
-    Uint8                   new_x, new_y, tmp;
-    object_t                *obj = avatar.obj;
+static const Uint8 *take_save_bytes(const Uint8 **p, const Uint8 *end, size_t size) {
+    const Uint8             *q = *p;
 
-    new_x = obj->x + avatar.sail_x;
-    new_y = obj->y + avatar.sail_y;
-    move_object(obj, new_x, new_y, obj->z);
-    advance_time(1);
+    if ((size_t)(end - q) < size)
+        return NULL;
+    *p = q + size;
+    return q;
+}
 
-    if (tilemap[obj->z][obj->y][obj->x] == TILE_DOCK)
-        enter_state(GAME_STATE_PLAY);
 
-    /* monkey patch the picture for drawing */
-    tmp = obj->picture; obj->picture = TILE_SHIP;
+/*----------------------------------------------------------------------------*/
+static void set_chunk_byte(int cx, int cy, int z, int offset, Uint8 value) {
+    int                     x, y;
+
+    x = (cx << MAP_CHUNK_SHIFT) + (offset & MAP_CHUNK_MASK);
+    y = (cy << MAP_CHUNK_SHIFT) + ((offset >> MAP_CHUNK_SHIFT) & MAP_CHUNK_MASK);
+    if (offset < MAP_CHUNK_BYTES / 2)   set_tile(x, y, z, value);
+    else                                set_code(x, y, z, value);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int read_save(const Uint8 *data, size_t size, int apply) {
+    const Uint8             *p = data, *end = data + size, *q, *records;
+    object_t                obj;
+    int                     i, count, cx, cy, z, offset, length;
+
+    /* the first pass only checks, the second applies it to a fresh world */
+    if ((q = take_save_bytes(&p, end, SAVE_HEADER_SIZE + SAVE_AVATAR_SIZE)) == NULL)
+        return 0;
+    if ((SDL_memcmp(q, SAVE_MAGIC, 4) != 0) || (q[4] != SAVE_VERSION) || (read_le32(q + 5) != hash_world()))
+        return 0;
+    q += SAVE_HEADER_SIZE;
+    if (read_le16(q) >= NUM_OBJECTS)
+        return 0;
+    if (apply) {
+        avatar.obj = &objects[read_le16(q)];
+        avatar.money = q[2];        avatar.keys = q[3];
+        avatar.torch = q[4];        avatar.time = q[5];
+        avatar.sword = q[6];        avatar.sword_life = q[7];
+        avatar.armor = q[8];        avatar.armor_life = q[9];
+        avatar.potions[0] = q[10];
+        avatar.potions[1] = q[11];
+        avatar.sail_x = (Sint8)q[12];
+        avatar.sail_y = (Sint8)q[13];
+        avatar.seed = (Uint16)read_le16(q + 14);
+    }
+
+    /* changed map chunks */
+    if ((q = take_save_bytes(&p, end, 2)) == NULL)
+        return 0;
+    for (count = read_le16(q); count > 0; --count) {
+        if ((q = take_save_bytes(&p, end, 3)) == NULL)
+            return 0;
+        z = q[0]; cx = q[1]; cy = q[2];
+        if ((z >= num_layers) || (cx >= map_cols) || (cy >= map_rows))
+            return 0;
+        for (;;) {
+            if ((q = take_save_bytes(&p, end, 3)) == NULL)
+                return 0;
+            offset = read_le16(q);
+            if ((length = q[2]) == 0)
+                break;
+            if ((offset + length > MAP_CHUNK_BYTES) || ((q = take_save_bytes(&p, end, length)) == NULL))
+                return 0;
+            for (i = 0; apply && (i < length); ++i)
+                set_chunk_byte(cx, cy, z, offset + i, q[i]);
+        }
+    }
 
-    clear_screen();
-    draw_map();
-    draw_hud();
+    /* changed objects */
+    if ((q = take_save_bytes(&p, end, 2)) == NULL)
+        return 0;
+    count = read_le16(q);
+    if ((records = take_save_bytes(&p, end, count * SAVE_OBJECT_SIZE)) == NULL)
+        return 0;
+    for (i = 0, q = records; i < count; ++i, q += SAVE_OBJECT_SIZE)
+        if ((read_le16(q) >= NUM_OBJECTS) || (read_le16(q + 3) >= (Uint32)map_width) || (read_le16(q + 5) >= (Uint32)map_height) ||
+            (q[7] >= num_layers) || (read_le16(q + 8) >= (Uint32)map_width) || (read_le16(q + 10) >= (Uint32)map_height) || (q[12] >= num_layers))
+            return 0;
+    if (apply) {
+        /* everything leaves the map before anything returns, they may swap places */
+        for (i = 0, q = records; i < count; ++i, q += SAVE_OBJECT_SIZE)
+            lift_object((Uint16)read_le16(q));
+        for (i = 0, q = records; i < count; ++i, q += SAVE_OBJECT_SIZE) {
+            obj.id = (Uint16)read_le16(q);
+            obj.picture = q[2];
+            obj.x = (Uint16)read_le16(q + 3);       obj.y = (Uint16)read_le16(q + 5);       obj.z = q[7];
+            obj.spawn_x = (Uint16)read_le16(q + 8); obj.spawn_y = (Uint16)read_le16(q + 10); obj.spawn_z = q[12];
+            obj.life = q[13];
+            place_object(obj.id, &obj, q[14]);
+        }
+    }
 
-    obj->picture = tmp;
+    /* hurt states */
+    if ((q = take_save_bytes(&p, end, 2)) == NULL)
+        return 0;
+    count = read_le16(q);
+    if ((records = take_save_bytes(&p, end, count * 3)) == NULL)
+        return 0;
+    for (i = 0, q = records; i < count; ++i, q += 3) {
+        if (read_le16(q) >= NUM_OBJECTS)
+            return 0;
+        if (apply)
+            hurt_states[read_le16(q)] = q[2];
+    }
+    return p == end;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_game_state_healer() {
-    static int              value = 0;
+static void rebuild_object_lists() {
+    const object_t          *obj;
+    int                     i;
 
-    if (btnp & BUTTON_A) {
-        avatar.money -= value * 3;
-        avatar.obj->life += value * 2;
-        enter_state(GAME_STATE_PLAY);
-    } else if (btnp & BUTTON_B) {
-        enter_state(GAME_STATE_PLAY);
-    } else if (btn & (BUTTON_UP | BUTTON_LEFT)) {
-        if (value > 0) --value;
-    } else if (btn & (BUTTON_DOWN | BUTTON_RIGHT)) {
-        ++value;
+    /* slots and lists follow from the objects themselves */
+    reset_object_slots();
+    dead_objects.count = hurt_objects.count = 0;
+    for (i = 0; i < NUM_OBJECTS; ++i) {
+        obj = &objects[i];
+        if (hurt_states[i] > 0)
+            add_to_list(&hurt_objects, (Uint16)i);
+        if (obj->picture == 0)
+            continue;
+        free_slots[i / 64] &= ~((Uint64)1 << (i % 64));
+        if (obj->life == 0)
+            add_to_list(&dead_objects, (Uint16)i);
     }
-
-    while ((avatar.obj->life + value * 2) > 255)    --value;
-    while ((value * 3) > avatar.money)              --value;
-
-    clear_screen();
-    draw_map();
-    draw_hud();
-
-    draw_box(2, 2, SCREEN_COLS - 6, 5);
-    draw_textf(3, 3,
-        "Do you need some healing?\n\n"
-        "%c %c%-3d for %c%-3d\n"
-        "\n"
-        "%c=Accept  %c=Deny",
-        TILE_UI_ARROW_0 + frame_animation,
-        TILE_HEART, value * 2,
-        TILE_MONEY, value * 3,
-        TILE_BUTTON_A, TILE_BUTTON_B
-    );
+    for (i = 0; i < NUM_OBJECTS / 64; ++i)
+        if (free_slots[i] == 0)
+            free_words &= ~((Uint64)1 << i);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_game_state_smith() {
-    static int              item = 0;
-    int                     i, cost;
+static void load_game() {
+    Uint8                   *data;
+    size_t                  size;
 
-    if (btnp & BUTTON_A) {
-        cost = ((item % 4) + 1) * 50;
-        if (avatar.money >= cost) {
-            if (item < 4) {
-                i = item + 1;
-                if (avatar.sword < i) {
-                    avatar.money -= cost;
-                    avatar.sword = i;
-                    avatar.sword_life = 64;
-                }
-            } else {
-                i = item - 4 + 1;
-                if (avatar.armor < i) {
-                    avatar.money -= cost;
-                    avatar.armor = i;
-                    avatar.armor_life = 64;
-                }
-            }
-        }
-    } else if (btnp & BUTTON_B) {
-        enter_state(GAME_STATE_PLAY);
-    } else if (btn & (BUTTON_UP | BUTTON_LEFT)) {
-        if (item > 0) --item;
-    } else if (btn & (BUTTON_DOWN | BUTTON_RIGHT)) {
-        if (item < 7) ++item;
+    if ((data = SDL_LoadFile(save_file, &size)) == NULL) {
+        SDL_Log("No save in %s", save_file);
+        return;
+    }
+    if (!read_save(data, size, 0)) {
+        SDL_Log("%s is not a save of %s!", save_file, world_file);
+        SDL_free(data);
+        return;
     }
 
-    clear_screen();
-    draw_map();
-    draw_hud();
-
-    draw_box(2, 2, SCREEN_COLS - 6, 12);
-    draw_text(3, 3, "Finest weapons and armor!");
-    for (i = 0; i < 4; ++i)
-        draw_textf(5, 5 + i, "%c +%d damage for %c%-3d", TILE_SWORD_0 + i, (i + 1) * 2, TILE_MONEY, (i + 1) * 50);
-    for (i = 0; i < 4; ++i)
-        draw_textf(5, 9 + i, "%c +%d armor  for %c%-3d", TILE_ARMOR_0 + i, (i + 1) * 2, TILE_MONEY, (i + 1) * 50);
-    draw_tile(3, 5 + item, TILE_UI_ARROW_0 + frame_animation);
-    draw_textf(3, 14, "   %c=Buy   %c=Goodbye...", TILE_BUTTON_A, TILE_BUTTON_B);
+    /* start over from the bytes the save was checked against, not from the
+       file on disk, which may have changed since; the second pass makes the
+       same checks on the same bytes and can't fail */
+    reset_world();
+    read_save(data, size, 1);
+    SDL_free(data);
+    rebuild_object_lists();
+    enter_state(GAME_STATE_PLAY);
+
+    /* a recording can't replay what came from the save */
+    if (record_rw != NULL) {
+        SDL_Log("Loaded %s, recording stopped", save_file);
+        stop_recording();
+    }
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_game_state_tavern() {
-    static int              item = 0;
-
-    if (btnp & BUTTON_A) {
-        switch (item) {
-            case 0: /* rest */
-                avatar.obj->spawn_x = avatar.obj->x;
-                avatar.obj->spawn_y = avatar.obj->y;
-                avatar.obj->spawn_z = avatar.obj->z;
-                enter_state(GAME_STATE_REST2);
-                break;
-            case 1: /* torch */
-                if ((avatar.money >= 15) && (avatar.torch < 255)) {
-                    avatar.money -= 15;
-                    avatar.torch = 255;
-                }
-                break;
-            case 2: /* potion */
-            case 3:
-                if ((avatar.money >= 250) && (avatar.potions[item - 2] == 0)) {
-                    avatar.money -= 250;
-                    avatar.potions[item - 2] = 2;
-                }
-                break;
-        }
-    } else if (btnp & BUTTON_B) {
-        enter_state(GAME_STATE_PLAY);
-    } else if (btn & (BUTTON_UP | BUTTON_LEFT)) {
-        if (item > 0) --item;
-    } else if (btn & (BUTTON_DOWN | BUTTON_RIGHT)) {
-        if (item < 3) ++item;
+static void load_tiles(SDL_Surface *bmp) {
+    SDL_Surface             *argb;
+    int                     y;
+
+    /* keep a decoded ARGB copy of the tiles for the CPU compositor */
+    if ((argb = SDL_ConvertSurfaceFormat(bmp, SDL_PIXELFORMAT_ARGB8888, 0)) == NULL)
+        panic("SDL_ConvertSurfaceFormat() failed: %s", SDL_GetError());
+    if ((argb->w != TILES_SIZE) || (argb->h != TILES_SIZE)) {
+        SDL_FreeSurface(argb);
+        panic("tiles.bmp must be %dx%d pixels!", TILES_SIZE, TILES_SIZE);
     }
+    for (y = 0; y < TILES_SIZE; ++y)
+        SDL_memcpy(tile_pixels[y], (const Uint8*)argb->pixels + y * argb->pitch, sizeof(tile_pixels[y]));
+    SDL_FreeSurface(argb);
+}
 
-    clear_screen();
-    draw_map();
-    draw_hud();
 
-    draw_box(2, 2, SCREEN_COLS - 6, 8);
-    draw_textf(3, 3,
-        "Welcome to the tavern!\n"
-        "\n"
-        "  Rest here.\n"
-        "  %c for %c%-3d\n"
-        "  %c for %c%-3d\n"
-        "  %c for %c%-3d\n"
-        "\n"
-        "   %c=Buy   %c=Goodbye...",
-        TILE_TORCH, TILE_MONEY, 15,
-        TILE_POTION_A, TILE_MONEY, 250,
-        TILE_POTION_B, TILE_MONEY, 250,
-        TILE_BUTTON_A, TILE_BUTTON_B
-    );
-    draw_tile(3, 5 + item, TILE_UI_ARROW_0 + frame_animation);
+/*----------------------------------------------------------------------------*/
+static void capture_world_state(world_state_t *state) {
+    const map_chunk_t       *chunk;
+    chunk_edit_t            *edit;
+    int                     i, count;
+
+    SDL_memcpy(state->objects, objects, sizeof(objects));
+    SDL_memcpy(state->pristine, pristine_objects, sizeof(pristine_objects));
+    SDL_memcpy(state->hurt_states, hurt_states, sizeof(hurt_states));
+    for (i = 0; i < NUM_OBJECTS; ++i)
+        state->on_map[i] = (Uint8)is_on_map(&objects[i]);
+    state->avatar = avatar;
+    state->width = map_width; state->height = map_height;
+
+    /* the player's map changes, next to the chunk they were made on */
+    for (count = i = 0; i < num_layers * map_cols * map_rows; ++i)
+        if ((map_slots[i] != NULL) && map_slots[i]->dirty)
+            ++count;
+    state->num_edits = 0;
+    if ((state->edits = SDL_malloc((count + 1) * sizeof(chunk_edit_t))) == NULL)
+        panic("SDL_malloc() failed!");
+    for (i = 0; i < num_layers * map_cols * map_rows; ++i) {
+        chunk = map_slots[i];
+        if ((chunk == NULL) || !chunk->dirty)
+            continue;
+        edit = &state->edits[state->num_edits++];
+        edit->cx = i % map_cols;
+        edit->cy = i / map_cols % map_rows;
+        edit->z = i / (map_cols * map_rows);
+        copy_chunk_bytes(chunk, edit->data);
+        if (!read_map_chunk(edit->cx, edit->cy, edit->z, edit->pristine))
+            SDL_zero(edit->pristine);
+    }
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_game_state_story() {
-    if (btnp & BUTTON_A) {
-        ++story_page; story_text = NULL;
-    } else if (btnp & BUTTON_B) {
-        enter_state(GAME_STATE_PLAY);
+static int restore_map_edits(const world_state_t *state) {
+    Uint8                   pristine[MAP_CHUNK_BYTES];
+    const chunk_edit_t      *edit;
+    int                     i, j, cx, cy, z, kept;
+
+    /* edits survive in chunks the new file left alone */
+    for (kept = i = 0; i < state->num_edits; ++i) {
+        edit = &state->edits[i];
+        cx = edit->cx; cy = edit->cy; z = edit->z;
+        if ((z >= num_layers) || (cx >= map_cols) || (cy >= map_rows))
+            continue;
+        if (!read_map_chunk(cx, cy, z, pristine))
+            SDL_zero(pristine);
+        if (SDL_memcmp(pristine, edit->pristine, MAP_CHUNK_BYTES) != 0)
+            continue;
+        for (j = 0; j < MAP_CHUNK_BYTES; ++j)
+            if (edit->data[j] != pristine[j])
+                set_chunk_byte(cx, cy, z, j, edit->data[j]);
+        ++kept;
     }
+    return kept;
+}
 
-    /* advance to next page if possible */
-    if (story_text == NULL) {
-        story_text = find_text(story_x, story_y, story_z, story_page);
-        if (story_text == NULL) {
-            enter_state(GAME_STATE_PLAY);
-            return;
-        }
-        story_lines = count_lines(story_text);
+
+/*----------------------------------------------------------------------------*/
+static int restore_objects(const world_state_t *state) {
+    const object_t          *old;
+    object_t                *obj;
+    int                     i;
+
+    if ((state->width == map_width) && (state->height == map_height) &&
+        (SDL_memcmp(state->pristine, pristine_objects, sizeof(pristine_objects)) == 0)) {
+        /* same spawns, so the same ids: put everything back as it was */
+        for (i = 0; i < NUM_OBJECTS; ++i)
+            if (is_changed(&state->objects[i], &state->pristine[i], state->on_map[i]))
+                lift_object((Uint16)i);
+        for (i = 0; i < NUM_OBJECTS; ++i)
+            if (is_changed(&state->objects[i], &state->pristine[i], state->on_map[i]))
+                place_object((Uint16)i, &state->objects[i], state->on_map[i]);
+        SDL_memcpy(hurt_states, state->hurt_states, sizeof(hurt_states));
+        rebuild_object_lists();
+        avatar = state->avatar;
+        return 1;
     }
-    
-    clear_screen();
-    draw_map();
-    draw_hud();
 
-    draw_box(0, 2, SCREEN_COLS - 2, story_lines + 2);
-    draw_text(1, 3, story_text);
-    draw_textf(SCREEN_COLS / 2 - 9, 3 + story_lines + 1, "%c=Continue   %c=Bye", TILE_BUTTON_A, TILE_BUTTON_B);
+    /* otherwise only the avatar keeps its place, life and belongings */
+    obj = avatar.obj;
+    old = &state->objects[state->avatar.obj->id];
+    avatar = state->avatar;
+    avatar.obj = obj;
+    if ((old->life > 0) && (old->z < num_layers) && (old->x < map_width) && (old->y < map_height) &&
+        (get_obj(old->x, old->y, old->z) == 0)) {
+        move_object(obj, old->x, old->y, old->z);
+        obj->life = old->life;
+    }
+    return 0;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_game_state_question() {
-    if (btnp & BUTTON_A)
-        enter_state(question_states[0]);
-    else if (btnp & BUTTON_B)
-        enter_state(question_states[1]);
-    
-    clear_screen();
-    draw_map();
-    draw_hud();
+static void reload_world() {
+    world_state_t           *state;
+    const Uint8             *data;
+    size_t                  size;
+    Uint64                  start;
+    double                  ms;
+    int                     kept, same, mapped;
+
+    start = SDL_GetPerformanceCounter();
+    if (!read_checked_world("reloading", &data, &size, &mapped))
+        return;
 
-    draw_box(2, 2, SCREEN_COLS - 6, question_lines + 2);
-    draw_text(3, 3, question_text);
-    draw_textf(3, 3 + question_lines + 1, "%c=Yes %c=No", TILE_BUTTON_A, TILE_BUTTON_B);
+    if ((state = SDL_malloc(sizeof(world_state_t))) == NULL)
+        panic("SDL_malloc() failed!");
+    capture_world_state(state);
+    install_world(data, size, mapped);
+    kept = restore_map_edits(state);
+    same = restore_objects(state);
+    ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    SDL_Log("Reloaded %s in %.1f ms, kept %d of %d changed chunks%s", world_file,
+        ms, kept, state->num_edits, same ? "" : ", objects respawned");
+    SDL_free(state->edits);
+    SDL_free(state);
+
+    if (record_rw != NULL) {
+        SDL_Log("Reloaded %s, recording stopped", world_file);
+        stop_recording();
+    }
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void on_tick() {
-    switch (game_state) {
-        case GAME_STATE_PLAY:       on_game_state_play(); break;
-        case GAME_STATE_REST:       on_game_state_rest(0); break;
-        case GAME_STATE_REST2:      on_game_state_rest(1); break;
-        case GAME_STATE_SAIL:       on_game_state_sail(); break;
-        case GAME_STATE_HEALER:     on_game_state_healer(); break;
-        case GAME_STATE_SMITH:      on_game_state_smith(); break;
-        case GAME_STATE_TAVERN:     on_game_state_tavern(); break;
-        case GAME_STATE_STORY:      on_game_state_story(); break;
-        case GAME_STATE_QUESTION:   on_game_state_question(); break;
+static void reload_tiles() {
+    SDL_Surface             *bmp;
+    SDL_Texture             *tex;
+
+    /* keep the old tiles if the new ones don't fit */
+    if ((bmp = SDL_LoadBMP(tiles_file)) == NULL) {
+        SDL_Log("Can't reload %s: %s", tiles_file, SDL_GetError());
+        return;
+    }
+    if ((bmp->w != TILES_SIZE) || (bmp->h != TILES_SIZE) || ((tex = SDL_CreateTextureFromSurface(renderer, bmp)) == NULL)) {
+        SDL_Log("Can't reload %s, it must be %dx%d pixels!", tiles_file, TILES_SIZE, TILES_SIZE);
+        SDL_FreeSurface(bmp);
+        return;
     }
+    load_tiles(bmp);
+    SDL_FreeSurface(bmp);
+    SDL_DestroyTexture(texture);
+    texture = tex;
+    invalidate_screen();
+    SDL_Log("Reloaded %s", tiles_file);
 }
 
 
-/*
-================================================================================
+#ifdef HAVE_INOTIFY
+/*----------------------------------------------------------------------------*/
+static const char *base_name(const char *path) {
+    const char              *slash = SDL_strrchr(path, '/');
+
+    return slash != NULL ? slash + 1 : path;
+}
 
-        I/O FUNCTIONS
 
-================================================================================
-*/
 /*----------------------------------------------------------------------------*/
-static void load_world() {
-    SDL_RWops               *rw;
-    int                     x, y, z, i, id;
+static int watch_dir(const char *path) {
+    char                    dir[1024];
+    size_t                  len = (size_t)(base_name(path) - path);
+
+    /* the directory, files get replaced rather than rewritten */
+    if (len == 0)
+        SDL_strlcpy(dir, ".", sizeof(dir));
+    else
+        SDL_strlcpy(dir, path, len + 1 < sizeof(dir) ? len + 1 : sizeof(dir));
+    return inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+}
+#endif
 
-    /* reset all data */
-    SDL_zero(tilemap);
-    SDL_zero(codemap);
-    SDL_zero(objects);
-    SDL_zero(avatar);
-    SDL_zero(objmap);
-    SDL_zero(text_data);
-    SDL_zero(text_info);
 
-    /* read the maps */
-    if ((rw = SDL_RWFromFile("world.dat", "rb")) == NULL)
-        panic("SDL_RWFromFile() failed: %s", SDL_GetError());
-    SDL_RWread(rw, tilemap, sizeof(tilemap), 1);
-    SDL_RWread(rw, codemap, sizeof(codemap), 1);
-    
-    /* read the strings */
-    SDL_RWread(rw, text_data, sizeof(text_data), 1);
-    for (i = 0; i < NUM_STRINGS; ++i) {
-        text_info[i].x = SDL_ReadU8(rw);
-        text_info[i].y = SDL_ReadU8(rw);
-        text_info[i].z = SDL_ReadU8(rw);
-        text_info[i].offset = SDL_ReadLE16(rw);
+/*----------------------------------------------------------------------------*/
+static void start_watching() {
+#ifdef HAVE_INOTIFY
+    if ((watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        SDL_Log("inotify_init1() failed, no hot reload");
+        return;
     }
+    world_watch = watch_dir(world_file);
+    tiles_watch = watch_dir(tiles_file);
+#endif
+}
 
-    SDL_RWclose(rw);
 
-    /* spawn objects */
-    for (z = 0; z < 2; ++z) {
-        for (y = 0; y < 256; ++y) {
-            for (x = 0; x < 256; ++x) {
-                id = codemap[z][y][x];
-                switch (id) {
-                    case TILE_SIGNAL_TILE:
-                        ++x;
-                        break;
-                    case TILE_AVATAR_0: case TILE_AVATAR_1:
-                    case TILE_DOOR_CLOSED: case TILE_DOOR_LOCKED: case TILE_DOOR_MAGIC:
-                    case TILE_CHEST_CLOSED: case TILE_FLAG_OFF:
-                        spawn_object(id, x, y, z);
-                        break;
-                    default:
-                        if ((id >= TILE_MONSTER_FIRST) && (id <= TILE_MONSTER_LAST))
-                            spawn_object(id, x, y, z);
-                        break;
-                }
-            }
+/*----------------------------------------------------------------------------*/
+static void poll_file_changes() {
+#ifdef HAVE_INOTIFY
+    union {
+        struct inotify_event    ev;
+        char                    data[4096];
+    }                       buf;
+    const struct inotify_event  *ev;
+    ssize_t                 i, len;
+
+    while ((watch_fd >= 0) && ((len = read(watch_fd, &buf, sizeof(buf))) > 0)) {
+        for (i = 0; i < len; i += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event*)(buf.data + i);
+            if (ev->len == 0)
+                continue;
+            if ((ev->wd == world_watch) && (SDL_strcmp(ev->name, base_name(world_file)) == 0))
+                reload_flags |= RELOAD_WORLD;
+            else if ((ev->wd == tiles_watch) && (SDL_strcmp(ev->name, base_name(tiles_file)) == 0))
+                reload_flags |= RELOAD_TILES;
+            else
+                continue;
+            /* give the writer time to finish */
+            reload_due = SDL_GetTicks() + RELOAD_DELAY;
         }
     }
+#endif
 
-    if (avatar.obj == NULL)
-        panic("World has no avatar!");
+    if ((reload_flags == 0) || ((Sint32)(SDL_GetTicks() - reload_due) < 0))
+        return;
+    if (reload_flags & RELOAD_WORLD)
+        reload_world();
+    if (reload_flags & RELOAD_TILES)
+        reload_tiles();
+    reload_flags = 0;
 }
 
 
@@ -1193,7 +4237,19 @@ static void handle_key_code(const SDL_KeyCode key, const int down) {
 
     if (down) {
         switch (key) {
-            case SDLK_F9:   load_world(); break;
+            case SDLK_F8:
+                if (target_texture != NULL)
+                    render_mode = render_mode == RENDER_MODE_TILES ? RENDER_MODE_TEXTURE : RENDER_MODE_TILES;
+                invalidate_screen();
+                break;
+            case SDLK_F7:
+                show_profile = !show_profile;
+                profiling = 1;
+                draw_profile();
+                break;
+            case SDLK_F5:   save_game(); break;
+            case SDLK_F6:   load_game(); break;
+            case SDLK_F9:   record_reload |= restart_world(); break;
             default:        break;
         }
     }
@@ -1218,6 +4274,8 @@ static void handle_SDL_events() {
     while (SDL_PollEvent(&ev)) {
         switch (ev.type) {
             case SDL_QUIT:      game_state = GAME_STATE_QUIT; break;
+            case SDL_WINDOWEVENT: update_screen_rect(); invalidate_screen(); break;
+            case SDL_RENDER_TARGETS_RESET: invalidate_screen(); break;
             case SDL_KEYDOWN:   handle_key_code(ev.key.keysym.sym, 1); break;
             case SDL_KEYUP:     handle_key_code(ev.key.keysym.sym, 0); break;
         }
@@ -1225,31 +4283,140 @@ static void handle_SDL_events() {
 }
 
 
+/*----------------------------------------------------------------------------*/
+static void run_tick() {
+    int                     state = game_state;
+    Uint64                  start;
+
+    ++frame_counter;
+    touch_map_chunks(avatar.obj->x, avatar.obj->y, avatar.obj->z);
+    frame_animation = (frame_counter >> 2) & 1;
+
+    start = profile_begin();
+    on_tick();
+    profile_current.state_ms[state] += profile_end(PROFILE_TICK, start);
+    ++profile_current.ticks;
+    if (show_profile)
+        draw_profile();
+    btnp = 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static double elapsed_ms(Uint64 since) {
+    return (double)(SDL_GetPerformanceCounter() - since) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void record_tick() {
+    Uint64                  now;
+    double                  ms;
+
+    now = SDL_GetPerformanceCounter();
+    if (pacing_stats.ticks > 0) {
+        ms = (double)(now - pacing_stats.last) * 1000.0 / SDL_GetPerformanceFrequency();
+        if ((pacing_stats.ticks == 1) || (ms < pacing_stats.min)) pacing_stats.min = ms;
+        if ((pacing_stats.ticks == 1) || (ms > pacing_stats.max)) pacing_stats.max = ms;
+        pacing_stats.sum += ms;
+        pacing_stats.sum_sq += ms * ms;
+    }
+    pacing_stats.last = now;
+    ++pacing_stats.ticks;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void wait_for_next_tick(double ms) {
+    Uint64                  start;
+
+    /* round up, waking a bit late is better than spinning for the rest */
+    if (ms <= 0.0)
+        return;
+    start = SDL_GetPerformanceCounter();
+    SDL_WaitEventTimeout(NULL, (int)ms + 1);
+    pacing_stats.idle += elapsed_ms(start);
+}
+
+
 /*----------------------------------------------------------------------------*/
 static void run_event_loop() {
-    Uint32                  last_tick, current_tick, frame_counter = 0;
+    Uint32                  last_tick, current_tick;
     double                  delta_ticks = 0.0;
+    Uint64                  start;
 
     clear_screen();
     clear_input();
 
+    pacing_stats.start = SDL_GetPerformanceCounter();
     last_tick = SDL_GetTicks();
     while (game_state != GAME_STATE_QUIT) {
+        start = profile_begin();
         handle_SDL_events();
+        poll_file_changes();
+        profile_end(PROFILE_EVENTS, start);
 
         current_tick = SDL_GetTicks();
         delta_ticks += current_tick - last_tick;
         last_tick = current_tick;
 
         for (; delta_ticks >= SCREEN_FPS_TICKS; delta_ticks -= SCREEN_FPS_TICKS) {
-            ++frame_counter;
-            frame_animation = (frame_counter >> 2) & 1;
-            on_tick();
-            btnp = 0;
+            record_tick();
+            if (record_rw != NULL)
+                record_tick_input();
+            run_tick();
         }
 
+        start = profile_begin();
         render_screen();
+        profile_end(PROFILE_RENDER, start);
+        profile_frame();
+
+        /* sleep until the next tick is due or an event arrives */
+        if (frame_pacing == FRAME_PACING_SLEEP)
+            wait_for_next_tick(SCREEN_FPS_TICKS - delta_ticks - (SDL_GetTicks() - last_tick));
+    }
+    pacing_stats.total = elapsed_ms(pacing_stats.start);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_headless() {
+    int                     run, i;
+    Uint64                  start;
+    double                  ms;
+
+    start = SDL_GetPerformanceCounter();
+    for (run = 0; run < headless_runs; ++run) {
+        /* every run starts from a pristine world */
+        load_world();
+        enter_state(GAME_STATE_PLAY);
+        healer_value = smith_item = tavern_item = 0;
+        frame_counter = 0;
+        avatar.seed = headless_seed + run;
+
+        for (i = 0; i < num_inputs; ++i) {
+            if (inputs[i].btn & INPUT_RELOAD)
+                load_world();
+            btn = inputs[i].btn & ~INPUT_RELOAD;
+            btnp = inputs[i].btnp;
+            run_tick();
+            profile_frame();
+            if ((hash_interval > 0) && (frame_counter % hash_interval == 0))
+                printf("run=%d tick=%u hash=%016llx\n", run, frame_counter, (unsigned long long)hash_state());
+        }
+
+        printf("run=%d seed=%u ticks=%d state=%d life=%u money=%u keys=%u time=%u x=%u y=%u z=%u hash=%016llx\n",
+            run, (Uint16)(headless_seed + run), num_inputs, game_state,
+            avatar.obj->life, avatar.money, avatar.keys, avatar.time,
+            avatar.obj->x, avatar.obj->y, avatar.obj->z,
+            (unsigned long long)hash_state());
     }
+
+    ms = elapsed_ms(start);
+    printf("runs=%d ticks=%.0f ms=%.1f ticks_per_sec=%.0f\n",
+        headless_runs, (double)headless_runs * num_inputs, ms,
+        ms > 0.0 ? (double)headless_runs * num_inputs * 1000.0 / ms : 0.0);
 }
 
 
@@ -1260,8 +4427,62 @@ static void run_event_loop() {
 
 ================================================================================
 */
+/*----------------------------------------------------------------------------*/
+static void print_stats() {
+    double                  n, mean, jitter;
+
+    SDL_Log("frames presented: %u, skipped: %u", render_stats.frames, render_stats.skipped);
+    SDL_Log("world layer redraws: %u", render_stats.world_draws);
+    SDL_Log("cells redrawn: %.0f total, %.1f per presented frame",
+        (double)render_stats.cells,
+        render_stats.frames > 0 ? (double)render_stats.cells / render_stats.frames : 0.0);
+
+    if (pacing_stats.ticks > 1) {
+        n = pacing_stats.ticks - 1;
+        mean = pacing_stats.sum / n;
+        jitter = pacing_stats.sum_sq / n - mean * mean;
+        jitter = jitter > 0.0 ? SDL_sqrt(jitter) : 0.0;
+        SDL_Log("tick interval: %.2f ms mean, %.2f ms min, %.2f ms max, %.2f ms jitter (target %.2f ms)",
+            mean, pacing_stats.min, pacing_stats.max, jitter, SCREEN_FPS_TICKS);
+    }
+    if (signal_stats.activations > 0)
+        SDL_Log("signals: %u activations, %.1f cells visited on average, %u max",
+            signal_stats.activations, (double)signal_stats.total_visited / signal_stats.activations,
+            signal_stats.max_visited);
+    if (map_stats.loads > 0)
+        SDL_Log("map chunks: %u loaded, %u evicted, %u resident (%u peak, %d allocated, %u object planes, %u KB) of %d layers",
+            map_stats.loads, map_stats.evictions, map_stats.resident, map_stats.peak, map_pool_size,
+            map_stats.obj_planes, (unsigned)((map_pool_size * sizeof(map_chunk_t) + map_stats.obj_planes * sizeof(obj_plane_t)) / 1024),
+            num_layers);
+    if (pool_exhausted > 0)
+        SDL_Log("object pool exhausted: %u failed spawns", pool_exhausted);
+    if (load_stats.loads > 0)
+        SDL_Log("startup: %.2f ms, first load_world: %.2f ms (%s)",
+            load_stats.startup, load_stats.first, world_mapped ? "mapped" : "read");
+    if (load_stats.loads > 1)
+        SDL_Log("reloads: %u, %.2f ms last, %.2f ms min, %.2f ms max",
+            load_stats.loads - 1, load_stats.last, load_stats.min, load_stats.max);
+    if (pacing_stats.total > 0.0)
+        SDL_Log("idle: %.0f ms of %.0f ms (%.1f%%)",
+            pacing_stats.idle, pacing_stats.total, pacing_stats.idle * 100.0 / pacing_stats.total);
+}
+
+
 /*----------------------------------------------------------------------------*/
 static void shutdown_game() {
+    stop_recording();
+    write_profile();
+    if (show_stats)
+        print_stats();
+    release_world_data();
+#ifdef HAVE_INOTIFY
+    if (watch_fd >= 0)
+        close(watch_fd);
+#endif
+    if (frame_texture != NULL)
+        SDL_DestroyTexture(frame_texture);
+    if (target_texture != NULL)
+        SDL_DestroyTexture(target_texture);
     if (texture != NULL)
         SDL_DestroyTexture(texture);
     if (renderer != NULL)
@@ -1283,7 +4504,7 @@ static void initialize_game() {
         panic("SDL_Init() failed: %s", SDL_GetError());
 
     /* determine best window resolution */
-    w = SCREEN_COLS * 8; h = SCREEN_ROWS * 8;
+    w = SCREEN_WIDTH; h = SCREEN_HEIGHT;
     if (SDL_GetDesktopDisplayMode(0, &dm) == 0) {
         dm.w *= 0.8f; dm.h *= 0.8f;
         while ((w < dm.w) && (h < dm.h)) { w *= 2; h *= 2; }
@@ -1295,27 +4516,94 @@ static void initialize_game() {
         panic("SDL_CreateWindow() failed: %s", SDL_GetError());
     if ((renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC)) == NULL)
         panic("SDL_CreateRenderer() failed: %s", SDL_GetError());
-    if (SDL_RenderSetLogicalSize(renderer, SCREEN_COLS * 8, SCREEN_ROWS * 8))
-        panic("SDL_RenderSetLogicalSize() failed: %s", SDL_GetError());
-    if ((bmp = SDL_LoadBMP("./dev/tiles.bmp")) == NULL)   
+    update_screen_rect();
+    if ((bmp = SDL_LoadBMP(tiles_file)) == NULL)
         panic("SDL_LoadBMP() failed: %s", SDL_GetError());
+    load_tiles(bmp);
     texture = SDL_CreateTextureFromSurface(renderer, bmp);
     SDL_FreeSurface(bmp);
     if (texture == NULL)
         panic("SDL_CreateTextureFromSurface() failed: %s", SDL_GetError());
+    if ((frame_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT)) == NULL)
+        panic("SDL_CreateTexture() failed: %s", SDL_GetError());
+    if (SDL_RenderTargetSupported(renderer)) {
+        if ((target_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, SCREEN_WIDTH, SCREEN_HEIGHT)) == NULL)
+            panic("SDL_CreateTexture() failed: %s", SDL_GetError());
+    } else {
+        render_mode = RENDER_MODE_TEXTURE;
+    }
 
     /* init audio system */
     // TODO
 
-    /* load resources */
+    /* load resources, watching first decides how the world is read */
+    start_watching();
     load_world();
 }
 
 
+/*----------------------------------------------------------------------------*/
+static void parse_arguments(int argc, char **argv) {
+    int                     i;
+
+    for (i = 1; i < argc; ++i) {
+        if (SDL_strcmp(argv[i], "-tiles") == 0)
+            render_mode = RENDER_MODE_TILES;
+        else if (SDL_strcmp(argv[i], "-stretch") == 0)
+            stretch_screen = 1;
+        else if (SDL_strcmp(argv[i], "-stats") == 0)
+            show_stats = 1;
+        else if (SDL_strcmp(argv[i], "-spin") == 0)
+            frame_pacing = FRAME_PACING_SPIN;
+        else if ((SDL_strcmp(argv[i], "-world") == 0) && (i + 1 < argc))
+            world_file = argv[++i];
+        else if ((SDL_strcmp(argv[i], "-headless") == 0) && (i + 1 < argc))
+            script_file = argv[++i];
+        else if ((SDL_strcmp(argv[i], "-replay") == 0) && (i + 1 < argc))
+            replay_file = argv[++i];
+        else if ((SDL_strcmp(argv[i], "-profile") == 0) && (i + 1 < argc))
+            profile_file = argv[++i];
+        else if ((SDL_strcmp(argv[i], "-record") == 0) && (i + 1 < argc))
+            record_file = argv[++i];
+        else if ((SDL_strcmp(argv[i], "-save") == 0) && (i + 1 < argc))
+            save_file = argv[++i];
+        else if ((SDL_strcmp(argv[i], "-hash") == 0) && (i + 1 < argc))
+            hash_interval = SDL_atoi(argv[++i]);
+        else if ((SDL_strcmp(argv[i], "-runs") == 0) && (i + 1 < argc))
+            headless_runs = SDL_atoi(argv[++i]);
+        else if ((SDL_strcmp(argv[i], "-seed") == 0) && (i + 1 < argc))
+            headless_seed = (Uint16)SDL_atoi(argv[++i]);
+        else
+            panic("Unknown argument: %s", argv[i]);
+    }
+    headless = (script_file != NULL) || (replay_file != NULL);
+    profiling = profile_file != NULL;
+}
+
+
 /*----------------------------------------------------------------------------*/
 int main(int argc, char **argv) {
-    (void)argc; (void)argv;
+    Uint64                  start;
+    int                     ok;
+
+    start = SDL_GetPerformanceCounter();
+    parse_arguments(argc, argv);
+    if (headless) {
+        if (SDL_Init(SDL_INIT_TIMER))
+            panic("SDL_Init() failed: %s", SDL_GetError());
+        if (script_file != NULL)
+            load_script(script_file);
+        if (replay_file != NULL)
+            load_replay(replay_file);
+        run_headless();
+        ok = write_profile();
+        SDL_Quit();
+        return ok ? 0 : 1;
+    }
     initialize_game();
+    if (record_file != NULL)
+        start_recording(record_file);
+    load_stats.startup = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
     run_event_loop();
     return 0;
 }